@@ -11,6 +11,9 @@ typedef RequestTranscribe = Pointer<Utf8> Function(
   Pointer<NativeFunction<ProgressCallback>>,
 );
 
+typedef FreeResultNative = Void Function(Pointer<Utf8>);
+typedef FreeResult = void Function(Pointer<Utf8>);
+
 var homePath = Platform.environment['HOME'] ?? "";
 var libName = "libmedia_podium_whisper.dylib";
 
@@ -36,6 +39,8 @@ class Task {
     final dylib = DynamicLibrary.open(libPath);
     final request =
         dylib.lookupFunction<RequestTranscribe, RequestTranscribe>('request');
+    final freeResult =
+        dylib.lookupFunction<FreeResultNative, FreeResult>('free_result');
 
     final params = jsonEncode(
       {
@@ -43,7 +48,6 @@ class Task {
         "model": modelFilePath,
         "file": wavFilePath,
         "language": "auto",
-        "diarize": true,
         "use_gpu": true,
       },
     );
@@ -56,6 +60,7 @@ class Task {
 
     print('task complete in: ${DateTime.now().difference(start).inSeconds}s');
     final data = jsonDecode(res.toDartString()) as Map<String, dynamic>;
+    freeResult(res);
     for (var i in data["segments"] as List<dynamic>) {
       print("${i['start']} --> ${i['end']}: ${i['text']}");
     }
@@ -1,16 +1,52 @@
 #include "whisper.cpp/whisper.h"
 #include "whisper.cpp/examples/common.h"
+#include "whisper.cpp/examples/common-ggml.h"
+#include "whisper.cpp/examples/dr_wav.h"
 #include "whisper.cpp/ggml.h"
 
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdarg>
+#include <cstring>
 #include <fstream>
 #include <cstdio>
+#include <condition_variable>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
 
+#if !defined(_WIN32)
+#include <csignal>
+#include <cerrno>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <sys/sysctl.h>
+#endif
+
 #include <iostream>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <set>
 #include "json/json.hpp"
 #include <stdio.h>
 
@@ -18,9 +54,30 @@ using json = nlohmann::json;
 
 typedef void (*progress_callback)(int progress);
 
+// where a job reports its progress: a callback from the C API, or one with context
+// such as the socket server's client. transcribeBatch calls it from its workers
+struct job_progress {
+    progress_callback cb = nullptr;
+
+    void (*cb_ctx)(void * ctx, int progress) = nullptr;
+    void * ctx = nullptr;
+
+    job_progress(progress_callback cb = nullptr) : cb(cb) {}
+    job_progress(void (*cb_ctx)(void *, int), void * ctx) : cb_ctx(cb_ctx), ctx(ctx) {}
+
+    void operator()(int progress) const {
+        if (cb != nullptr) {
+            cb(progress);
+        } else if (cb_ctx != nullptr) {
+            cb_ctx(ctx, progress);
+        }
+    }
+};
+
 struct whisper_params {
     int32_t n_threads    = std::min(4, (int32_t) std::thread::hardware_concurrency());
     int32_t n_processors =  1;
+    int32_t parallel     =  1; // concurrent jobs sharing one loaded model
     int32_t offset_t_ms  =  0;
     int32_t offset_n     =  0;
     int32_t duration_ms  =  0;
@@ -47,412 +104,5312 @@ struct whisper_params {
     bool no_timestamps   = false;
     bool log_score       = false;
     bool use_gpu         = true;
+    bool quantize_save   = true;
+    bool word_timestamps = false;
+    bool token_data      = false;
 
     std::string language  = "en";
     std::string prompt;
     std::string model     = "models/ggml-base.en.bin";
+    std::string quantize;  // q4_0, q4_1, q5_0, q5_1 or q8_0 - quantize f16/f32 weights on load
+    std::string draft_model;
 
     // [TDRZ] speaker turn string
     std::string tdrz_speaker_turn = " [SPEAKER_TURN]"; // TODO: set from command line
 
     std::string openvino_encode_device = "CPU";
 
+    int32_t log_level = -1; // -1: process-wide level
+
+    int32_t progress_interval_ms = 250;
+
+    int32_t deadline_ms = 0; // from arrival, 0: none
+
+    std::string checkpoint; // journal of finished segments
+    bool        resume = false;
+
+    // temperature fallback budget, -1/0: unlimited
+    int32_t fallback_max_window  = -1;
+    int32_t fallback_max_total   = -1;
+    int32_t fallback_deadline_ms =  0;
+
     std::vector<std::string> fname_inp = {};
     std::vector<std::string> fname_out = {};
-};
-
-struct whisper_print_user_data {
-    const whisper_params * params;
-    const std::vector<std::vector<float>> * pcmf32s;
-    int progress_prev;
-    progress_callback progress_callback;
-};
 
-char *jsonToChar(json jsonData) {
-    std::string result = jsonData.dump(-1, ' ', false, json::error_handler_t::ignore);
-    char *ch = new char[result.size() + 1];
-    strcpy(ch, result.c_str());
-    return ch;
-}
+    std::vector<std::string> output_formats = {}; // txt, srt, vtt, lrc
 
-//  500 -> 00:05.000
-// 6000 -> 01:00.000
-std::string to_timestamp(int64_t t, bool comma = false) {
-    int64_t msec = t * 10;
-    int64_t hr = msec / (1000 * 60 * 60);
-    msec = msec - hr * (1000 * 60 * 60);
-    int64_t min = msec / (1000 * 60);
-    msec = msec - min * (1000 * 60);
-    int64_t sec = msec / 1000;
-    msec = msec - sec * 1000;
+    std::string cpus;           // cpu list to pin the job to, e.g. "0-7,16-23"
+    int32_t     numa_node = -1; // node to pin the job and its memory to
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+    bool huge_pages = false; // advise a model loaded by this job, and its states, for huge pages
 
-    return std::string(buf);
-}
+    int32_t pcm_format = 0; // whisper_pcm_format the job's audio is held in
+};
 
-int timestamp_to_sample(int64_t t, int n_samples) {
-    return std::max(0, std::min((int) n_samples - 1, (int) ((t*WHISPER_SAMPLE_RATE)/100)));
-}
+// per-job pipeline clock driven by the whisper callbacks:
+//   progress       -> top of every window (and once more before exiting)
+//   encoder_begin  -> the window is about to be encoded
+//   logits_filter  -> the first call in a window marks the end of encode + prompt
+struct whisper_stage_clock {
+    int64_t t_full_start_us   = 0;
+    int64_t t_encode_start_us = 0;
+    int64_t t_decode_start_us = 0;
+    int     n_window          = -1;
+    bool    mel_done          = false;
 
-std::string estimate_diarization_speaker(std::vector<std::vector<float>> pcmf32s, int64_t t0, int64_t t1, bool id_only = false) {
-    std::string speaker = "";
-    const int64_t n_samples = pcmf32s[0].size();
+    // totals for jobs on a pooled state, which whisper_print_timings() can't report
+    int64_t t_mel_us    = 0;
+    int64_t t_encode_us = 0;
+    int64_t t_decode_us = 0;
+    int     n_encode    = 0;
+    int     n_decode    = 0;
+};
 
-    const int64_t is0 = timestamp_to_sample(t0, n_samples);
-    const int64_t is1 = timestamp_to_sample(t1, n_samples);
+// audio positions are in whisper time units (10 ms)
+struct whisper_progress_tracker {
+    int64_t job_id      = 0;
+    int64_t interval_us = 0;
+    int64_t t_start_us  = 0;
+    int64_t t_last_us   = 0;
+    int64_t t_offset    = 0;
+    int64_t t_total     = 0;
+    int64_t t_processed = 0;
+};
 
-    double energy0 = 0.0f;
-    double energy1 = 0.0f;
+// whisper.cpp retries a window at increasing temperatures when the result fails
+// the entropy or logprob thresholds. it doesn't report the retries as they happen,
+// but every attempt starts with the decoders at an empty sequence, which the
+// logits filter sees as n_tokens == 0 (once per decoder)
+struct whisper_fallback_budget {
+    int     max_window    = -1; // -1: whisper's own schedule
+    int     max_total     = -1; // -1: unlimited
+    int64_t t_deadline_us =  0; //  0: none
 
-    for (int64_t j = is0; j < is1; j++) {
-        energy0 += fabs(pcmf32s[0][j]);
-        energy1 += fabs(pcmf32s[1][j]);
-    }
+    bool enabled   = true;  // fallbacks allowed in the current pass
+    bool at_start  = false; // decoders are on the first token of an attempt
+    int  n_attempt = 0;     // attempts in the current window
+    int  n_total   = 0;     // fallbacks so far
+    int  n_capped  = 0;     // windows that used every fallback they were allowed
+};
 
-    if (energy0 > 1.1*energy1) {
-        speaker = "0";
-    } else if (energy1 > 1.1*energy0) {
-        speaker = "1";
-    } else {
-        speaker = "?";
-    }
+// how a job holds its decoded audio. whisper.cpp takes F32 PCM, the 16-bit formats
+// halve the memory of a long recording and are converted back one chunk at a time,
+// see whisper_transcribe()
+enum whisper_pcm_format {
+    WHISPER_PCM_F32,
+    WHISPER_PCM_F16,
+    WHISPER_PCM_S16,
+};
 
-    //printf("is0 = %lld, is1 = %lld, energy0 = %f, energy1 = %f, speaker = %s\n", is0, is1, energy0, energy1, speaker.c_str());
+static const char * k_pcm_format_str[] = { "f32", "f16", "s16" };
 
-    if (!id_only) {
-        speaker.insert(0, "(speaker ");
-        speaker.append(")");
-    }
+// audio held in a 16-bit format is converted at most this much at a time, 10 ms units
+#define PCM_CHUNK_LEN (5*60*100)
 
-    return speaker;
-}
-void whisper_print_progress_callback(struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, int progress, void * user_data) {
-    int progress_step = ((whisper_print_user_data *) user_data)->params->progress_step;
-    int * progress_prev  = &(((whisper_print_user_data *) user_data)->progress_prev);
-    if (progress >= *progress_prev + progress_step) {
-        *progress_prev += progress_step;
-        fprintf(stderr, "%s: progress = %3d%%\n", __func__, progress);
-        progress_callback cb = ((whisper_print_user_data *) user_data)->progress_callback;
-        if (cb != nullptr) {
-            (*cb)(progress);
+static int whisper_pcm_format_from_str(const std::string & str) {
+    for (int i = 0; i < (int) (sizeof(k_pcm_format_str)/sizeof(k_pcm_format_str[0])); ++i) {
+        if (str == k_pcm_format_str[i]) {
+            return i;
         }
     }
+    return -1;
 }
 
-void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * user_data) {
-    const auto & params  = *((whisper_print_user_data *) user_data)->params;
-    const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
+// the samples of one channel, only the vector of the format is used
+struct whisper_pcm_samples {
+    using allocator_type = std::pmr::polymorphic_allocator<>;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    int format = WHISPER_PCM_F32;
 
-    std::string speaker = "";
+    std::pmr::vector<float>       f32;
+    std::pmr::vector<ggml_fp16_t> f16;
+    std::pmr::vector<int16_t>     s16;
 
-    int64_t t0 = 0;
-    int64_t t1 = 0;
+    explicit whisper_pcm_samples(const allocator_type & alloc = {}) : f32(alloc), f16(alloc), s16(alloc) {}
 
-    // print the last n_new segments
-    const int s0 = n_segments - n_new;
+    // for a pmr::vector of channels
+    whisper_pcm_samples(const whisper_pcm_samples & other, const allocator_type & alloc)
+        : format(other.format), f32(other.f32, alloc), f16(other.f16, alloc), s16(other.s16, alloc) {}
+    whisper_pcm_samples(whisper_pcm_samples && other, const allocator_type & alloc)
+        : format(other.format), f32(std::move(other.f32), alloc), f16(std::move(other.f16), alloc), s16(std::move(other.s16), alloc) {}
 
-    if (s0 == 0) {
-        printf("\n");
+    whisper_pcm_samples(const whisper_pcm_samples &) = default;
+    whisper_pcm_samples(whisper_pcm_samples &&) = default;
+    whisper_pcm_samples & operator=(const whisper_pcm_samples &) = default;
+    whisper_pcm_samples & operator=(whisper_pcm_samples &&) = default;
+
+    size_t size() const {
+        switch (format) {
+            case WHISPER_PCM_F16: return f16.size();
+            case WHISPER_PCM_S16: return s16.size();
+            default:              return f32.size();
+        }
     }
 
-    for (int i = s0; i < n_segments; i++) {
-        if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+    size_t bytes() const {
+        return f32.size()*sizeof(float) + f16.size()*sizeof(ggml_fp16_t) + s16.size()*sizeof(int16_t);
+    }
+
+    void reserve(size_t n) {
+        switch (format) {
+            case WHISPER_PCM_F16: f16.reserve(n); break;
+            case WHISPER_PCM_S16: s16.reserve(n); break;
+            default:              f32.reserve(n); break;
+        }
+    }
+
+    void resize(size_t n) {
+        switch (format) {
+            case WHISPER_PCM_F16: f16.resize(n); break;
+            case WHISPER_PCM_S16: s16.resize(n); break;
+            default:              f32.resize(n); break;
         }
+    }
 
-        if (!params.no_timestamps) {
-            printf("[%s --> %s]  ", to_timestamp(t0).c_str(), to_timestamp(t1).c_str());
+    static int16_t to_s16(float v) {
+        return (int16_t) std::lround(std::min(std::max(v*32768.0f, -32768.0f), 32767.0f));
+    }
+
+    void push_back(float v) {
+        switch (format) {
+            case WHISPER_PCM_F16: f16.push_back(ggml_fp32_to_fp16(v)); break;
+            case WHISPER_PCM_S16: s16.push_back(to_s16(v));            break;
+            default:              f32.push_back(v);                    break;
         }
+    }
 
-        if (params.diarize && pcmf32s.size() == 2) {
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
+    void set(size_t i, float v) {
+        switch (format) {
+            case WHISPER_PCM_F16: f16[i] = ggml_fp32_to_fp16(v); break;
+            case WHISPER_PCM_S16: s16[i] = to_s16(v);            break;
+            default:              f32[i] = v;                    break;
         }
+    }
 
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        printf("%s%s", speaker.c_str(), text);
+    float operator[](size_t i) const {
+        switch (format) {
+            case WHISPER_PCM_F16: return ggml_fp16_to_fp32(f16[i]);
+            case WHISPER_PCM_S16: return s16[i]/32768.0f;
+            default:              return f32[i];
+        }
+    }
 
-        if (params.tinydiarize) {
-            if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
-                printf("%s", params.tdrz_speaker_turn.c_str());
+    // samples [i0, i0 + n) as F32 PCM: in place for F32, otherwise converted into buf
+    const float * read(size_t i0, size_t n, std::pmr::vector<float> & buf) const {
+        if (format == WHISPER_PCM_F32) {
+            return f32.data() + i0;
+        }
+        buf.resize(n);
+        if (format == WHISPER_PCM_F16) {
+            ggml_fp16_to_fp32_row(f16.data() + i0, buf.data(), (int) n);
+        } else {
+            for (size_t i = 0; i < n; ++i) {
+                buf[i] = s16[i0 + i]/32768.0f;
             }
         }
+        return buf.data();
+    }
+};
 
-        // with timestamps or speakers: each segment on new line
-        if (!params.no_timestamps || params.diarize) {
-            printf("\n");
-        }
-
-        fflush(stdout);
-    }
-}
-
-whisper_params whisper_params_parse(json data) {
-    struct whisper_params params;
-    if (data["threads"].is_number_integer()     ) { params.n_threads              = data["threads"].get<int32_t>() ;       }
-    if (data["processors"].is_number_integer()  ) { params.n_processors           = data["processors"].get<int32_t>();     }
-    if (data["offset-t"].is_number_integer()    ) { params.offset_t_ms            = data["offset-t"].get<int32_t>();       }
-    if (data["offset-n"].is_number_integer()    ) { params.offset_n               = data["offset-n"].get<int32_t>();       }
-    if (data["duration"].is_number_integer()    ) { params.duration_ms            = data["duration"].get<int32_t>();       }
-    if (data["max-context"].is_number_integer() ) { params.max_context            = data["max-context"].get<int32_t>();    }
-    if (data["max-len"].is_number_integer()     ) { params.max_len                = data["max-len"].get<int32_t>();        }
-    if (data["best-of"].is_number_integer()     ) { params.best_of                = data["best-of"].get<int32_t>();        }
-    if (data["beam-size"].is_number_integer()   ) { params.beam_size              = data["beam-size"].get<int32_t>();      }
-    if (data["word-thold"].is_number_float()    ) { params.word_thold             = data["word-thold"].get<float>();       }
-    if (data["entropy-thold"].is_number_float() ) { params.entropy_thold          = data["entropy-thold"].get<float>();    }
-    if (data["logprob-thold"].is_number_float() ) { params.logprob_thold          = data["logprob-thold"].get<float>();    }
-    if (data["language"].is_string()            ) { params.language               = data["language"].get<std::string>();   }
-    if (data["prompt"].is_string()              ) { params.prompt                 = data["prompt"].get<std::string>();     }
-    if (data["model"].is_string()               ) { params.model                  = data["model"].get<std::string>();      }
-    if (data["translate"].is_boolean()          ) { params.translate              = data["translate"].get<bool>();         }
-    if (data["use_gpu"].is_boolean()            ) { params.use_gpu                = data["use_gpu"].get<bool>();         }
-    if (data["ov-e-device"].is_string()         ) { params.openvino_encode_device = data["ov-e-device"].get<std::string>();}
-    if (data["file"].is_string()                ) { params.fname_inp.emplace_back(data["file"]);                           }
-    params.speed_up               = false; 
-    params.debug_mode             = false; 
-    params.diarize                = false; 
-    params.tinydiarize            = false; 
-    params.split_on_word          = false; 
-    params.no_fallback            = false; 
-    params.print_special          = false; 
-    params.print_progress         = true; 
-    params.no_timestamps          = false; 
-    params.detect_language        = false;
-    params.log_score              = false;
-    return params;
-}
-
-bool is_aborted = false;
-
-json transcribe(json jsonBody, progress_callback progress_cb) {
-    json jsonResult;
-    jsonResult["@type"] = "transcribe";
-    jsonResult["segments"] = {};
+struct whisper_output_writer;
+struct whisper_checkpoint;
 
-    whisper_params params = whisper_params_parse(jsonBody);
+// the clock and fallback count of one whisper state. whisper_full_parallel() runs the
+// encoder and logits callbacks of every processor, each on its own state, and the
+// progress callback of the first one only
+struct whisper_processor {
+    std::atomic<whisper_state *> state{nullptr}; // claimed by the first callback of the pass
 
-    if (params.fname_inp.empty()) {
-        jsonResult["@type"] = "error";
-        jsonResult["message"] = "no input files specified";
-        return jsonResult;
-    }
+    whisper_stage_clock     clock;
+    whisper_fallback_budget fallback;
 
-    if (params.language != "auto" && whisper_lang_id(params.language.c_str()) == -1) {
-        jsonResult["@type"] = "error";
-        jsonResult["message"] = "unknown language";
-        return jsonResult;
-    }
+    // the logits filter has nothing to record until the next window or attempt
+    std::atomic<bool> logits_idle{false};
+};
 
-    if (params.diarize && params.tinydiarize) {
-        jsonResult["@type"] = "error";
-        jsonResult["message"] = "error: cannot use both --diarize and --tinydiarize";
-        return jsonResult;
-    }
+struct whisper_print_user_data {
+    const whisper_params * params = nullptr;
+    const std::pmr::vector<whisper_pcm_samples> * pcm_stereo = nullptr;
+    int progress_prev = 0;
+    job_progress progress_cb;
+    whisper_stage_clock clock;        // totals of the passes so far
+    whisper_progress_tracker progress;
+    whisper_output_writer * writer = nullptr;
+    whisper_fallback_budget fallback; // settings, and the counts of the passes so far
 
-    // whisper init
-    struct whisper_context_params cparams;
-    cparams.use_gpu = params.use_gpu;
-    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    std::unique_ptr<whisper_processor[]> processors; // one per state of the current pass
+    int n_processors = 0;
 
-    if (ctx == nullptr) {
-        jsonResult["@type"] = "error";
-        jsonResult["message"] = "failed to initialize whisper context";
-        return jsonResult;
-    }
+    // whisper.cpp runs the logits filter on several threads, and with n_processors > 1
+    // the encoder callback too
+    std::mutex callback_mutex;
 
-    // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-    whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+    // a job runs as one or more passes over the audio, see whisper_transcribe()
+    int64_t t_pass_offset   = 0; // start of the pass in the audio, 10 ms units
+    int64_t t_pass_len      = 0;
+    int     n_segments_prev = 0; // segments returned by earlier passes
+    bool    stop_pass       = false;
+    int64_t t_hold          = INT64_MAX; // segments ending after this wait for the end of the pass
 
-    // for (int f = 0; f < (int) params.fname_inp.size(); ++f) {
-    for (int f = 0; f < 1; ++f) {
-        const auto fname_inp = params.fname_inp[f];
-        const auto fname_out = f < (int) params.fname_out.size() && !params.fname_out[f].empty() ? params.fname_out[f] : params.fname_inp[f];
+    whisper_checkpoint * checkpoint = nullptr;
 
-        std::vector<float> pcmf32;               // mono-channel F32 PCM
-        std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
+    int n_emitted = 0; // segments passed to the writer and the checkpoint
 
-        if (!::read_wav(fname_inp, pcmf32, pcmf32s, params.diarize)) {
-            fprintf(stderr, "error: failed to read WAV file '%s'\n", fname_inp.c_str());
-            jsonResult["@type"] = "error";
-            jsonResult["message"] = "error: failed to read WAV file ";
-            return jsonResult;
-        }
+    int64_t t_deadline_us = 0; // 0: none
+    std::atomic<bool> deadline_hit{false};
 
-        // print system information
-        {
-            fprintf(stderr, "\n");
-            fprintf(stderr, "system_info: n_threads = %d / %d\n", params.n_threads*params.n_processors, std::thread::hardware_concurrency());
+    const std::atomic<bool> * stopped = nullptr; // the job's flag, set by stop_transcribe()
+};
+
+//
+// logging
+//
+// messages are formatted on the calling thread into a fixed-size lock-free ring
+// buffer and written out by a background thread, so the decode thread never
+// blocks on stdio. library builds are silent unless a level is requested
+//
+
+enum log_level {
+    LOG_LEVEL_NONE  = 0,
+    LOG_LEVEL_ERROR = 1,
+    LOG_LEVEL_WARN  = 2,
+    LOG_LEVEL_INFO  = 3,
+    LOG_LEVEL_DEBUG = 4,
+};
+
+#if defined(DART_SHARED_LIB)
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_NONE
+#else
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SIZE 1024
+#define LOG_LINE_MAX  512
+
+// bounded multi-producer ring (Vyukov). producers never block: try_push fails
+// when the ring is full. pops are serialized by the caller
+template <typename T, size_t N>
+struct mpsc_ring {
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+    struct slot {
+        std::atomic<uint64_t> seq{0};
+        T value;
+    };
+
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+
+    slot slots[N];
+
+    mpsc_ring() {
+        for (uint64_t i = 0; i < N; ++i) {
+            slots[i].seq.store(i, std::memory_order_relaxed);
         }
+    }
 
-        // print some info about the processing
-        {
-            fprintf(stderr, "\n");
-            if (!whisper_is_multilingual(ctx)) {
-                if (params.language != "en" || params.translate) {
-                    params.language = "en";
-                    params.translate = false;
-                    fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
+    template <typename F>
+    bool try_push(F && fill) {
+        uint64_t pos = head.load(std::memory_order_relaxed);
+        slot * s = nullptr;
+        for (;;) {
+            s = &slots[pos & (N - 1)];
+            const int64_t diff = (int64_t) s->seq.load(std::memory_order_acquire) - (int64_t) pos;
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
                 }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
             }
-            if (params.detect_language) {
-                params.language = "auto";
-            }
-            fprintf(stderr, "%s: processing '%s' (%d samples, %.1f sec), %d threads, %d processors, %d beams + best of %d, lang = %s, task = %s, %stimestamps = %d ...\n",
-                    __func__, fname_inp.c_str(), int(pcmf32.size()), float(pcmf32.size())/WHISPER_SAMPLE_RATE,
-                    params.n_threads, params.n_processors, params.beam_size, params.best_of,
-                    params.language.c_str(),
-                    params.translate ? "translate" : "transcribe",
-                    params.tinydiarize ? "tdrz = 1, " : "",
-                    params.no_timestamps ? 0 : 1);
+        }
 
-            fprintf(stderr, "\n");
+        fill(s->value);
+
+        s->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <typename F>
+    bool try_pop(F && consume) {
+        const uint64_t pos = tail.load(std::memory_order_relaxed);
+        slot & s = slots[pos & (N - 1)];
+        if (s.seq.load(std::memory_order_acquire) != pos + 1) {
+            return false;
         }
 
-        // run the inference
-        {
-            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+        consume(s.value);
 
-            wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
+        s.seq.store(pos + N, std::memory_order_release);
+        tail.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+};
 
-            wparams.print_realtime   = false;
-            wparams.print_progress   = params.print_progress;
-            wparams.print_timestamps = !params.no_timestamps;
-            wparams.print_special    = params.print_special;
-            wparams.translate        = params.translate;
-            wparams.language         = params.language.c_str();
-            wparams.detect_language  = params.detect_language;
-            wparams.n_threads        = params.n_threads;
-            wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
-            wparams.offset_ms        = params.offset_t_ms;
-            wparams.duration_ms      = params.duration_ms;
+struct log_line {
+    char text[LOG_LINE_MAX];
+};
 
-            wparams.token_timestamps = params.max_len > 0;
-            wparams.thold_pt         = params.word_thold;
-            wparams.max_len          = params.max_len;
-            wparams.split_on_word    = params.split_on_word;
+struct log_state {
+    std::atomic<int>      level{LOG_DEFAULT_LEVEL};
+    std::atomic<uint64_t> dropped{0};
 
-            wparams.speed_up         = params.speed_up;
-            wparams.debug_mode       = params.debug_mode;
+    std::mutex sink_mutex;
+    FILE *     sink = nullptr; // nullptr -> stderr
 
-            wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+    std::once_flag started;
 
-            wparams.initial_prompt   = params.prompt.c_str();
+    mpsc_ring<log_line, LOG_RING_SIZE> ring;
+};
 
-            wparams.greedy.best_of        = params.best_of;
-            wparams.beam_search.beam_size = params.beam_size;
+static log_state g_log;
 
-            wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
-            wparams.entropy_thold    = params.entropy_thold;
-            wparams.logprob_thold    = params.logprob_thold;
+// per-request override of the process-wide level, -1 = not set
+static thread_local int g_log_level_job = -1;
 
-            whisper_print_user_data user_data = { &params, &pcmf32s, 0, progress_cb };
+static bool log_enabled(int level) {
+    const int max_level = g_log_level_job >= 0 ? g_log_level_job : g_log.level.load(std::memory_order_relaxed);
+    return level <= max_level;
+}
 
-            // this callback is called on each new segment
-            if (!wparams.print_realtime) {
-                wparams.new_segment_callback           = whisper_print_segment_callback;
-                wparams.new_segment_callback_user_data = &user_data;
-            }
+static void log_drain() {
+    std::lock_guard<std::mutex> lock(g_log.sink_mutex);
+    FILE * out = g_log.sink != nullptr ? g_log.sink : stderr;
 
-            if (wparams.print_progress) {
-                wparams.progress_callback              = whisper_print_progress_callback;
-                wparams.progress_callback_user_data = &user_data;
-            }
+    bool wrote = false;
 
-            // examples for abort mechanism
-            // in examples below, we do not abort the processing, but we could if the flag is set to true
+    const uint64_t dropped = g_log.dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+        fprintf(out, "log: %llu messages dropped\n", (unsigned long long) dropped);
+        wrote = true;
+    }
 
-            // the callback is called before every encoder run - if it returns false, the processing is aborted
-            {
-                wparams.encoder_begin_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, void * user_data) {
-                    bool is_aborted = *(bool*)user_data;
-                    return !is_aborted;
-                };
-                wparams.encoder_begin_callback_user_data = &is_aborted;
-            }
+    while (g_log.ring.try_pop([&](const log_line & line) { fputs(line.text, out); })) {
+        wrote = true;
+    }
 
-            // the callback is called before every computation - if it returns true, the computation is aborted
-            {
-                static bool is_aborted = false; // NOTE: this should be atomic to avoid data race
+    if (wrote) {
+        fflush(out);
+    }
+}
 
-                wparams.abort_callback = [](void * user_data) {
-                    bool is_aborted = *(bool*)user_data;
-                    return is_aborted;
-                };
-                wparams.abort_callback_user_data = &is_aborted;
+static void log_start_writer() {
+    std::call_once(g_log.started, []() {
+        std::thread([]() {
+            for (;;) {
+                log_drain();
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
             }
+        }).detach();
+    });
+}
 
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
-                fprintf(stderr, "failed to process audio\n");
-                jsonResult["@type"] = "error";
-                jsonResult["message"] = "inference failed";
-                return jsonResult;
-            }
+static void log_write(int level, const char * fmt, ...) {
+    if (!log_enabled(level)) {
+        return;
+    }
 
-            const int n_segments = whisper_full_n_segments(ctx);
-            for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-                std::string speaker = "";
+    log_start_writer();
 
-                if (params.diarize && pcmf32s.size() == 2)
-                {
-                    speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
-                }
+    va_list args;
+    va_start(args, fmt);
+    const bool queued = g_log.ring.try_push([&](log_line & line) {
+        vsnprintf(line.text, LOG_LINE_MAX, fmt, args);
+    });
+    va_end(args);
 
-                json segment;
-                segment["text"] = text;
-                segment["end"] = t1;
-                segment["start"] = t0;
-                segment["speaker"] = speaker;
-                jsonResult["segments"].push_back(segment);
-            }
-        }
+    // when the writer falls behind the message is dropped rather than blocking
+    if (!queued) {
+        g_log.dropped.fetch_add(1, std::memory_order_relaxed);
     }
-    whisper_free(ctx);
-    return jsonResult;
 }
 
-extern "C" {
-    void stop_transcribe() {
-        is_aborted = true;
+// blocks until everything queued so far has been written
+static void log_flush() {
+    const uint64_t head = g_log.ring.head.load(std::memory_order_acquire);
+    while (g_log.ring.tail.load(std::memory_order_acquire) < head) {
+        log_drain();
     }
+}
 
-    char *request(char *body, progress_callback progress_cb) {
-        json jsonBody = json::parse(body);
-        json jsonResult;
+struct log_level_scope {
+    int prev;
 
-        if (jsonBody["@type"] == "transcribe") {
-            return jsonToChar(transcribe(jsonBody, progress_cb));
-        }
+    log_level_scope(int level) : prev(g_log_level_job) {
+        g_log_level_job = level;
+    }
 
-        if (jsonBody["@type"] == "getVersion") {
-            jsonResult["@type"] = "version";
-            jsonResult["message"] = "version lib v0.0.0";
-            return jsonToChar(jsonResult);
-        }
+    ~log_level_scope() {
+        g_log_level_job = prev;
+    }
+};
 
-        jsonResult["@type"] = "error";
-        jsonResult["message"] = "method not found";
+static int log_level_from_str(const std::string & str) {
+    if (str == "none")  { return LOG_LEVEL_NONE;  }
+    if (str == "error") { return LOG_LEVEL_ERROR; }
+    if (str == "warn")  { return LOG_LEVEL_WARN;  }
+    if (str == "info")  { return LOG_LEVEL_INFO;  }
+    if (str == "debug") { return LOG_LEVEL_DEBUG; }
+    return -1;
+}
 
-        return jsonToChar(jsonResult);
+#define LOG_ERR(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WRN(...) log_write(LOG_LEVEL_WARN,  __VA_ARGS__)
+#define LOG_INF(...) log_write(LOG_LEVEL_INFO,  __VA_ARGS__)
+#define LOG_DBG(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// whisper.cpp keeps its per-stage counters private and only reports them
+// through whisper_print_timings(), so we capture that report from the log
+// callback while the job's thread is printing it
+struct whisper_stage_timing {
+    float ms   = 0.0f;
+    int   runs = 0;
+};
+
+struct whisper_timings {
+    float load_ms     = 0.0f;
+    float quantize_ms = 0.0f;
+    float mel_ms      = 0.0f;
+
+    whisper_stage_timing sample;
+    whisper_stage_timing encode;
+    whisper_stage_timing decode;
+    whisper_stage_timing batchd;
+    whisper_stage_timing prompt;
+
+    int fallbacks_p = 0; // logprob threshold failures
+    int fallbacks_h = 0; // entropy threshold failures
+};
+
+static thread_local whisper_timings * g_timings_capture = nullptr;
+
+static void whisper_parse_timings_line(const char * line, whisper_timings & timings) {
+    const char * eq = strchr(line, '=');
+    if (eq == nullptr) {
+        return;
+    }
+
+    std::string key(line, eq - line);
+    key.erase(0, key.find_first_not_of(' '));
+    key.erase(key.find_last_not_of(' ') + 1);
+
+    whisper_stage_timing * stage = nullptr;
+    if      (key == "sample time") { stage = &timings.sample; }
+    else if (key == "encode time") { stage = &timings.encode; }
+    else if (key == "decode time") { stage = &timings.decode; }
+    else if (key == "batchd time") { stage = &timings.batchd; }
+    else if (key == "prompt time") { stage = &timings.prompt; }
+
+    if (stage != nullptr) {
+        sscanf(eq + 1, "%f ms / %d runs", &stage->ms, &stage->runs);
+    } else if (key == "load time") {
+        sscanf(eq + 1, "%f", &timings.load_ms);
+    } else if (key == "mel time") {
+        sscanf(eq + 1, "%f", &timings.mel_ms);
+    } else if (key == "fallbacks") {
+        sscanf(eq + 1, "%d p / %d h", &timings.fallbacks_p, &timings.fallbacks_h);
     }
 }
 
-int main(int argc, char ** argv) {
-    json jsonBody = json::parse(R"({
+static void whisper_log_callback(enum ggml_log_level level, const char * text, void * /*user_data*/) {
+    static const char prefix[] = "whisper_print_timings:";
+    if (g_timings_capture != nullptr && strncmp(text, prefix, sizeof(prefix) - 1) == 0) {
+        whisper_parse_timings_line(text + sizeof(prefix) - 1, *g_timings_capture);
+        return;
+    }
+
+    switch (level) {
+        case GGML_LOG_LEVEL_ERROR: LOG_ERR("%s", text); break;
+        case GGML_LOG_LEVEL_WARN:  LOG_WRN("%s", text); break;
+        default:                   LOG_INF("%s", text); break;
+    }
+}
+
+static void whisper_collect_timings(struct whisper_context * ctx, whisper_timings & timings) {
+    g_timings_capture = &timings;
+    whisper_print_timings(ctx);
+    g_timings_capture = nullptr;
+}
+
+static void whisper_lib_init() {
+    static std::once_flag once;
+    std::call_once(once, []() {
+        whisper_log_set(whisper_log_callback, nullptr);
+    });
+}
+
+static int64_t time_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// high-water mark of the process resident set, in bytes
+static int64_t peak_rss_bytes() {
+#if defined(_WIN32)
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#if defined(__APPLE__)
+    return (int64_t) usage.ru_maxrss;
+#else
+    return (int64_t) usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+//
+// tracing
+//
+// spans are written to a fixed-size lock-free ring buffer and exported on demand
+// as Chrome trace JSON (chrome://tracing, Perfetto). when tracing is disabled the
+// only cost at each instrumentation point is a relaxed atomic load
+//
+
+#define TRACE_CAPACITY (1 << 16)
+
+struct trace_event {
+    // 0 while the slot is being written, otherwise (ring index + 1)
+    std::atomic<uint64_t>     seq{0};
+    std::atomic<const char *> name{nullptr};
+    std::atomic<int64_t>      ts_us{0};
+    std::atomic<int64_t>      dur_us{0};
+    std::atomic<int64_t>      arg{-1};
+    std::atomic<uint32_t>     tid{0};
+};
+
+struct trace_buffer {
+    std::atomic<bool>     enabled{false};
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    trace_event events[TRACE_CAPACITY];
+};
+
+static trace_buffer g_trace;
+
+static bool trace_enabled() {
+    return g_trace.enabled.load(std::memory_order_relaxed);
+}
+
+static uint32_t trace_thread_id() {
+    static std::atomic<uint32_t> n_threads{0};
+    static thread_local uint32_t tid = ++n_threads;
+    return tid;
+}
+
+// name must point to static storage
+static void trace_record(const char * name, int64_t t_start_us, int64_t t_end_us, int64_t arg = -1) {
+    if (!trace_enabled()) {
+        return;
+    }
+
+    const uint64_t idx = g_trace.head.fetch_add(1, std::memory_order_relaxed);
+    trace_event & ev = g_trace.events[idx & (TRACE_CAPACITY - 1)];
+
+    ev.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    ev.name  .store(name,                  std::memory_order_relaxed);
+    ev.ts_us .store(t_start_us,            std::memory_order_relaxed);
+    ev.dur_us.store(t_end_us - t_start_us, std::memory_order_relaxed);
+    ev.arg   .store(arg,                   std::memory_order_relaxed);
+    ev.tid   .store(trace_thread_id(),     std::memory_order_relaxed);
+
+    ev.seq.store(idx + 1, std::memory_order_release);
+}
+
+struct trace_span {
+    const char * name;
+    int64_t      arg;
+    int64_t      t_start_us = 0;
+
+    trace_span(const char * name, int64_t arg = -1) : name(trace_enabled() ? name : nullptr), arg(arg) {
+        if (this->name != nullptr) {
+            t_start_us = time_us();
+        }
+    }
+
+    ~trace_span() {
+        if (name != nullptr) {
+            trace_record(name, t_start_us, time_us(), arg);
+        }
+    }
+};
+
+json trace_to_json() {
+    const uint64_t head = g_trace.head.load(std::memory_order_acquire);
+    const uint64_t tail = std::max(g_trace.tail.load(std::memory_order_relaxed), head > TRACE_CAPACITY ? head - TRACE_CAPACITY : 0);
+
+    json events = json::array();
+    for (uint64_t idx = tail; idx < head; ++idx) {
+        const trace_event & ev = g_trace.events[idx & (TRACE_CAPACITY - 1)];
+
+        const uint64_t seq0 = ev.seq.load(std::memory_order_acquire);
+        if (seq0 != idx + 1) {
+            continue;
+        }
+
+        const char *   name   = ev.name  .load(std::memory_order_relaxed);
+        const int64_t  ts_us  = ev.ts_us .load(std::memory_order_relaxed);
+        const int64_t  dur_us = ev.dur_us.load(std::memory_order_relaxed);
+        const int64_t  arg    = ev.arg   .load(std::memory_order_relaxed);
+        const uint32_t tid    = ev.tid   .load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (ev.seq.load(std::memory_order_relaxed) != seq0) {
+            continue; // overwritten while reading
+        }
+
+        json event;
+        event["name"] = name;
+        event["cat"]  = "whisper";
+        event["ph"]   = "X";
+        event["ts"]   = ts_us;
+        event["dur"]  = dur_us;
+        event["pid"]  = 1;
+        event["tid"]  = tid;
+        if (arg >= 0) {
+            event["args"]["index"] = arg;
+        }
+        events.push_back(event);
+    }
+
+    json trace;
+    trace["traceEvents"]     = events;
+    trace["displayTimeUnit"] = "ms";
+    return trace;
+}
+
+//
+// metrics
+//
+// process-wide counters and histograms updated lock-free from the transcription
+// path and exported in the Prometheus text exposition format
+//
+
+struct metrics_counter {
+    const char * name;
+    const char * help;
+    double       scale = 1.0; // exported value = raw value * scale
+
+    std::atomic<uint64_t> value{0};
+
+    void add(uint64_t n = 1) {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+};
+
+#define METRICS_MAX_BUCKETS 16
+
+struct metrics_histogram {
+    const char * name;
+    const char * help;
+    std::vector<double> bounds; // upper bounds in seconds, ascending
+
+    std::atomic<uint64_t> buckets[METRICS_MAX_BUCKETS + 1] = {}; // last one is +Inf
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum_us{0};
+
+    void observe_us(int64_t us) {
+        us = std::max<int64_t>(us, 0);
+        const double seconds = us/1e6;
+
+        size_t i = 0;
+        while (i < bounds.size() && seconds > bounds[i]) {
+            i++;
+        }
+
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum_us.fetch_add(us, std::memory_order_relaxed);
+    }
+};
+
+struct metrics_registry {
+    metrics_counter jobs_started   { "whisper_jobs_started_total",   "Transcription jobs started." };
+    metrics_counter jobs_completed { "whisper_jobs_completed_total", "Transcription jobs that finished successfully." };
+    metrics_counter jobs_aborted   { "whisper_jobs_aborted_total",   "Transcription jobs stopped before finishing." };
+    metrics_counter jobs_deadline  { "whisper_jobs_deadline_exceeded_total", "Transcription jobs that returned partial results at their deadline." };
+    metrics_counter jobs_failed    { "whisper_jobs_failed_total",    "Transcription jobs that returned an error." };
+    metrics_counter audio_seconds  { "whisper_audio_seconds_total",  "Seconds of audio processed by completed jobs.", 1e-3 };
+
+    metrics_histogram queue_wait { "whisper_job_queue_wait_seconds", "Time between a job arriving and starting work.",
+        { 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1.0, 5.0, 10.0, 30.0 } };
+    metrics_histogram encode     { "whisper_encode_seconds",         "Encoder latency per 30 s window, including the prompt pass.",
+        { 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0 } };
+    metrics_histogram decode     { "whisper_decode_seconds",         "Decoder latency per 30 s window, including temperature fallbacks.",
+        { 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0 } };
+};
+
+static metrics_registry g_metrics;
+
+static void metrics_write_counter(std::string & out, const metrics_counter & counter) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s counter\n%s %.17g\n",
+            counter.name, counter.help, counter.name, counter.name,
+            counter.value.load(std::memory_order_relaxed)*counter.scale);
+    out += buf;
+}
+
+static void metrics_write_histogram(std::string & out, const metrics_histogram & hist) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s histogram\n", hist.name, hist.help, hist.name);
+    out += buf;
+
+    // buckets are updated independently, so the cumulative counts are a best-effort snapshot
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i <= hist.bounds.size(); ++i) {
+        cumulative += hist.buckets[i].load(std::memory_order_relaxed);
+        if (i < hist.bounds.size()) {
+            snprintf(buf, sizeof(buf), "%s_bucket{le=\"%g\"} %llu\n", hist.name, hist.bounds[i], (unsigned long long) cumulative);
+        } else {
+            snprintf(buf, sizeof(buf), "%s_bucket{le=\"+Inf\"} %llu\n", hist.name, (unsigned long long) cumulative);
+        }
+        out += buf;
+    }
+
+    snprintf(buf, sizeof(buf), "%s_sum %.6f\n%s_count %llu\n",
+            hist.name, hist.sum_us.load(std::memory_order_relaxed)/1e6,
+            hist.name, (unsigned long long) hist.count.load(std::memory_order_relaxed));
+    out += buf;
+}
+
+std::string metrics_to_prometheus() {
+    std::string out;
+    metrics_write_counter(out, g_metrics.jobs_started);
+    metrics_write_counter(out, g_metrics.jobs_completed);
+    metrics_write_counter(out, g_metrics.jobs_aborted);
+    metrics_write_counter(out, g_metrics.jobs_deadline);
+    metrics_write_counter(out, g_metrics.jobs_failed);
+    metrics_write_counter(out, g_metrics.audio_seconds);
+    metrics_write_histogram(out, g_metrics.queue_wait);
+    metrics_write_histogram(out, g_metrics.encode);
+    metrics_write_histogram(out, g_metrics.decode);
+    return out;
+}
+
+//
+// progress
+//
+// the compute thread only fills in a snapshot and queues it, at most once per
+// progress_interval_ms. snapshots are handed to the listener from a dispatcher
+// thread, or polled with progress_poll() when no listener is registered
+//
+
+struct whisper_progress {
+    int64_t job_id;
+    int32_t percent;
+    float   processed_s; // seconds of audio processed so far
+    float   total_s;     // seconds of audio to process
+    float   elapsed_s;   // wall time since inference started
+    float   eta_s;       // estimated remaining wall time, -1 while unknown
+    float   rtf;         // elapsed_s / processed_s
+};
+
+typedef void (*progress_listener)(const whisper_progress * progress);
+
+#define PROGRESS_RING_SIZE 256
+
+struct progress_state {
+    std::atomic<progress_listener> listener{nullptr};
+    std::atomic<uint64_t>          dropped{0};
+
+    std::mutex     pop_mutex;
+    std::once_flag started;
+
+    mpsc_ring<whisper_progress, PROGRESS_RING_SIZE> ring;
+};
+
+static progress_state g_progress;
+
+static std::atomic<int64_t> g_job_id{0};
+
+static void progress_start_dispatcher() {
+    std::call_once(g_progress.started, []() {
+        std::thread([]() {
+            for (;;) {
+                {
+                    std::lock_guard<std::mutex> lock(g_progress.pop_mutex);
+                    progress_listener listener = g_progress.listener.load(std::memory_order_acquire);
+                    while (listener != nullptr && g_progress.ring.try_pop([&](const whisper_progress & progress) { listener(&progress); })) {
+                    }
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }).detach();
+    });
+}
+
+static void whisper_progress_update(whisper_progress_tracker & tracker, int64_t t_processed, bool force) {
+    tracker.t_processed = std::min(std::max(tracker.t_processed, t_processed), tracker.t_total);
+
+    const int64_t t_now_us = time_us();
+    if (!force && t_now_us - tracker.t_last_us < tracker.interval_us) {
+        return;
+    }
+    tracker.t_last_us = t_now_us;
+
+    const float elapsed_s   = (t_now_us - tracker.t_start_us)/1e6f;
+    const float processed_s = tracker.t_processed/100.0f;
+    const float total_s     = tracker.t_total/100.0f;
+
+    auto fill = [&](whisper_progress & progress) {
+        progress.job_id      = tracker.job_id;
+        progress.percent     = tracker.t_total > 0 ? (int32_t) (100*tracker.t_processed/tracker.t_total) : 100;
+        progress.processed_s = processed_s;
+        progress.total_s     = total_s;
+        progress.elapsed_s   = elapsed_s;
+        progress.eta_s       = processed_s > 0.0f ? elapsed_s*(total_s - processed_s)/processed_s : -1.0f;
+        progress.rtf         = processed_s > 0.0f ? elapsed_s/processed_s : 0.0f;
+    };
+
+    if (g_progress.ring.try_push(fill)) {
+        return;
+    }
+
+    // a full ring drops its oldest snapshot, so that a host polling late still gets
+    // the latest ones. when the dispatcher holds the ring it is draining it, and the
+    // new snapshot is dropped instead of waiting for the listener
+    std::unique_lock<std::mutex> lock(g_progress.pop_mutex, std::try_to_lock);
+    if (lock.owns_lock() && g_progress.ring.try_pop([](const whisper_progress &) {})) {
+        g_progress.ring.try_push(fill);
+    }
+    g_progress.dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void whisper_clock_on_progress(whisper_stage_clock & clock) {
+    const int64_t t_now_us = time_us();
+
+    if (!clock.mel_done) {
+        // includes language auto-detection, which runs right after the mel
+        trace_record("mel", clock.t_full_start_us, t_now_us);
+        clock.t_mel_us += t_now_us - clock.t_full_start_us;
+        clock.mel_done = true;
+    }
+
+    if (clock.t_decode_start_us > 0) {
+        trace_record("decode", clock.t_decode_start_us, t_now_us, clock.n_window);
+        g_metrics.decode.observe_us(t_now_us - clock.t_decode_start_us);
+        clock.t_decode_us += t_now_us - clock.t_decode_start_us;
+        clock.n_decode++;
+    } else if (clock.t_encode_start_us > 0) {
+        trace_record("encode", clock.t_encode_start_us, t_now_us, clock.n_window);
+        g_metrics.encode.observe_us(t_now_us - clock.t_encode_start_us);
+        clock.t_encode_us += t_now_us - clock.t_encode_start_us;
+        clock.n_encode++;
+    }
+
+    clock.t_encode_start_us = 0;
+    clock.t_decode_start_us = 0;
+}
+
+static void whisper_clock_on_encoder_begin(whisper_stage_clock & clock) {
+    // the first processor's window already ended with the progress callback, the others' end here
+    whisper_clock_on_progress(clock);
+
+    clock.n_window++;
+    clock.t_encode_start_us = time_us();
+    clock.t_decode_start_us = 0;
+}
+
+static void whisper_clock_on_logits(whisper_stage_clock & clock) {
+    if (clock.t_decode_start_us > 0 || clock.t_encode_start_us == 0) {
+        return;
+    }
+
+    clock.t_decode_start_us = time_us();
+    trace_record("encode", clock.t_encode_start_us, clock.t_decode_start_us, clock.n_window);
+    g_metrics.encode.observe_us(clock.t_decode_start_us - clock.t_encode_start_us);
+    clock.t_encode_us += clock.t_decode_start_us - clock.t_encode_start_us;
+    clock.n_encode++;
+}
+
+static void whisper_fallback_window_end(whisper_fallback_budget & budget) {
+    if (budget.enabled && budget.max_window > 0 && budget.n_attempt > budget.max_window) {
+        budget.n_capped++;
+    }
+    budget.n_attempt = 0;
+    budget.at_start  = false;
+}
+
+// called before every window. returns false when the pass has to stop because the
+// budget is used up while fallbacks are still enabled
+static bool whisper_fallback_window_begin(whisper_fallback_budget & budget) {
+    whisper_fallback_window_end(budget);
+
+    if (!budget.enabled) {
+        return true;
+    }
+
+    const bool over_total = budget.max_total >= 0 && budget.n_total >= budget.max_total;
+    const bool over_time  = budget.t_deadline_us > 0 && time_us() >= budget.t_deadline_us;
+
+    return !over_total && !over_time;
+}
+
+static void whisper_fallback_on_logits(whisper_fallback_budget & budget, int n_tokens) {
+    if (n_tokens > 0) {
+        budget.at_start = false;
+        return;
+    }
+
+    if (budget.at_start) {
+        return;
+    }
+
+    budget.at_start = true;
+    if (++budget.n_attempt > 1) {
+        budget.n_total++;
+    }
+}
+
+// the processor running on state. a state's first callback of the pass claims a free one
+static whisper_processor & whisper_processor_for(whisper_print_user_data & data, whisper_state * state) {
+    for (int i = 0; i < data.n_processors; ++i) {
+        whisper_processor & processor = data.processors[i];
+
+        whisper_state * cur = processor.state.load(std::memory_order_acquire);
+        if (cur == nullptr && processor.state.compare_exchange_strong(cur, state, std::memory_order_acq_rel)) {
+            return processor;
+        }
+        if (cur == state) {
+            return processor;
+        }
+    }
+    return data.processors[data.n_processors - 1];
+}
+
+// before a pass: every processor starts from the job's fallback settings and counts
+static void whisper_processors_begin(whisper_print_user_data & data) {
+    const int64_t t_now_us = time_us();
+
+    for (int i = 0; i < data.n_processors; ++i) {
+        whisper_processor & processor = data.processors[i];
+        processor.state.store(nullptr, std::memory_order_relaxed);
+        processor.clock = whisper_stage_clock();
+        processor.clock.t_full_start_us = t_now_us;
+        processor.fallback = data.fallback;
+        processor.logits_idle.store(false, std::memory_order_relaxed);
+    }
+}
+
+// after a pass: closes the processors' last windows and adds them to the job's totals
+static void whisper_processors_end(whisper_print_user_data & data) {
+    const whisper_fallback_budget base = data.fallback;
+
+    for (int i = 0; i < data.n_processors; ++i) {
+        whisper_processor & processor = data.processors[i];
+        if (processor.state.load(std::memory_order_relaxed) == nullptr) {
+            continue;
+        }
+
+        whisper_clock_on_progress(processor.clock);
+        whisper_fallback_window_end(processor.fallback);
+
+        data.clock.t_mel_us    += processor.clock.t_mel_us;
+        data.clock.t_encode_us += processor.clock.t_encode_us;
+        data.clock.t_decode_us += processor.clock.t_decode_us;
+        data.clock.n_encode    += processor.clock.n_encode;
+        data.clock.n_decode    += processor.clock.n_decode;
+
+        data.fallback.n_total  += processor.fallback.n_total  - base.n_total;
+        data.fallback.n_capped += processor.fallback.n_capped - base.n_capped;
+    }
+}
+
+// wall-clock stage times from the callbacks. decode includes sampling and fallbacks
+static void whisper_clock_timings(const whisper_stage_clock & clock, whisper_timings & timings) {
+    timings.mel_ms      = clock.t_mel_us/1000.0f;
+    timings.encode.ms   = clock.t_encode_us/1000.0f;
+    timings.encode.runs = clock.n_encode;
+    timings.decode.ms   = clock.t_decode_us/1000.0f;
+    timings.decode.runs = clock.n_decode;
+}
+
+// current resident set, in bytes
+static int64_t current_rss_bytes() {
+#if defined(__APPLE__)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t) &info, &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    return (int64_t) info.resident_size;
+#elif defined(__linux__)
+    FILE * f = fopen("/proc/self/statm", "r");
+    if (f == nullptr) {
+        return 0;
+    }
+    long pages_total    = 0;
+    long pages_resident = 0;
+    const int n = fscanf(f, "%ld %ld", &pages_total, &pages_resident);
+    fclose(f);
+    return n == 2 ? (int64_t) pages_resident*sysconf(_SC_PAGESIZE) : 0;
+#else
+    return 0;
+#endif
+}
+
+static int64_t file_size_bytes(const std::string & path) {
+#if defined(_WIN32)
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    return f ? (int64_t) f.tellg() : 0;
+#else
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? (int64_t) st.st_size : 0;
+#endif
+}
+
+// cpus this process may run on, with SMT siblings counted once as physical cores
+struct cpu_topology {
+    int n_logical  = 1;
+    int n_physical = 1;
+};
+
+#if defined(__linux__)
+static int read_int_file(const char * path, int fallback) {
+    FILE * f = fopen(path, "r");
+    if (f == nullptr) {
+        return fallback;
+    }
+    int value = fallback;
+    if (fscanf(f, "%d", &value) != 1) {
+        value = fallback;
+    }
+    fclose(f);
+    return value;
+}
+#endif
+
+static cpu_topology cpu_topology_get() {
+    cpu_topology topology;
+    topology.n_logical  = std::max(1, (int) std::thread::hardware_concurrency());
+    topology.n_physical = topology.n_logical;
+
+#if defined(__linux__)
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return topology;
+    }
+
+    std::set<std::pair<int, int>> cores; // (package, core)
+    int n_logical = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &set)) {
+            continue;
+        }
+        n_logical++;
+
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        const int package = read_int_file(path, 0);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        const int core = read_int_file(path, cpu);
+        cores.emplace(package, core);
+    }
+
+    if (n_logical > 0) {
+        topology.n_logical  = n_logical;
+        topology.n_physical = cores.size();
+    }
+#elif defined(__APPLE__)
+    int n_physical = 0;
+    size_t size = sizeof(n_physical);
+    if (sysctlbyname("hw.physicalcpu", &n_physical, &size, nullptr, 0) == 0 && n_physical > 0) {
+        topology.n_physical = std::min(n_physical, topology.n_logical);
+    }
+#endif
+
+    return topology;
+}
+
+//
+// cpu affinity
+//
+// a job can be pinned to a cpu list ("cpus", e.g. "0-7,16-23") or a NUMA node
+// ("numa_node"), or both - the list then narrows the node. ggml starts its
+// threads from the job's thread on every graph compute, and they inherit the
+// job thread's affinity and memory policy, so pinning that one thread pins the
+// whole job. with a node, the memory the job touches first - its states and,
+// for a copy loaded by the job, the weights - is preferred on that node.
+// Linux only
+//
+
+struct cpu_affinity_defaults {
+    std::mutex  mutex;
+    std::string cpus;
+    int32_t     numa_node = -1;
+};
+
+static cpu_affinity_defaults g_affinity;
+
+static void cpu_affinity_defaults_apply(whisper_params & params) {
+    std::lock_guard<std::mutex> lock(g_affinity.mutex);
+    params.cpus      = g_affinity.cpus;
+    params.numa_node = g_affinity.numa_node;
+}
+
+#if defined(__linux__)
+// "0-3,8,10-11" style lists, as in /sys/devices/system/node/node*/cpulist
+static bool cpu_list_parse(const std::string & list, cpu_set_t & set) {
+    CPU_ZERO(&set);
+
+    const char * p = list.c_str();
+    while (*p != '\0' && *p != '\n') {
+        char * end = nullptr;
+        const long first = strtol(p, &end, 10);
+        if (end == p || first < 0) {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return false;
+            }
+            p = end;
+        }
+        if (last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            CPU_SET(cpu, &set);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && *p != '\n') {
+            return false;
+        }
+    }
+
+    return CPU_COUNT(&set) > 0;
+}
+
+static bool numa_node_cpus(int node, cpu_set_t & set) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+    std::ifstream f(path);
+    std::string list;
+    return std::getline(f, list) && cpu_list_parse(list, set);
+}
+#endif
+
+// free memory on a NUMA node, -1 when unknown
+static int64_t numa_node_free_bytes(int node) {
+#if defined(__linux__)
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/meminfo", node);
+
+    std::ifstream f(path);
+    std::string line;
+    while (std::getline(f, line)) {
+        long long kb = 0;
+        if (sscanf(line.c_str(), "Node %*d MemFree: %lld kB", &kb) == 1) {
+            return kb*1024;
+        }
+    }
+#endif
+    (void) node;
+    return -1;
+}
+
+// pins the calling thread for the scope's lifetime
+struct cpu_affinity_scope {
+#if defined(__linux__)
+    cpu_set_t saved;
+    bool      has_saved  = false;
+
+    // the memory policy in force before, restored with the affinity
+    int           saved_mode = MPOL_DEFAULT;
+    unsigned long saved_nodes[1024/(8*sizeof(unsigned long))] = {};
+    bool          has_policy = false;
+#endif
+
+    cpu_affinity_scope() = default;
+    cpu_affinity_scope(const cpu_affinity_scope &) = delete;
+
+    bool init(const whisper_params & params, std::string & error) {
+        if (params.cpus.empty() && params.numa_node < 0) {
+            return true;
+        }
+
+#if defined(__linux__)
+        cpu_set_t set;
+        if (params.numa_node >= 0 && !numa_node_cpus(params.numa_node, set)) {
+            error = "unknown numa_node " + std::to_string(params.numa_node);
+            return false;
+        }
+        if (!params.cpus.empty()) {
+            cpu_set_t cpus;
+            if (!cpu_list_parse(params.cpus, cpus)) {
+                error = "invalid cpus, expected a list such as \"0-7,16-23\"";
+                return false;
+            }
+            if (params.numa_node >= 0) {
+                CPU_AND(&set, &set, &cpus);
+            } else {
+                set = cpus;
+            }
+        }
+
+        if (sched_getaffinity(0, sizeof(saved), &saved) != 0) {
+            error = std::string("sched_getaffinity failed: ") + strerror(errno);
+            return false;
+        }
+        if (CPU_COUNT(&set) == 0 || sched_setaffinity(0, sizeof(set), &set) != 0) {
+            error = "none of the requested cpus is available";
+            return false;
+        }
+        has_saved = true;
+
+        if (params.numa_node >= 0) {
+            // preferred rather than bound, so a full node spills over instead of failing
+            unsigned long nodemask[1024/(8*sizeof(unsigned long))] = {}; // numa_node_cpus() found the node, so it is < 1024
+            nodemask[params.numa_node/(8*sizeof(unsigned long))] |= 1ul << (params.numa_node % (8*sizeof(unsigned long)));
+            if (syscall(SYS_get_mempolicy, &saved_mode, saved_nodes, 1024 + 1, nullptr, 0) != 0) {
+                LOG_WRN("%s: get_mempolicy failed: %s\n", __func__, strerror(errno));
+            } else if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask, 1024 + 1) != 0) {
+                LOG_WRN("%s: set_mempolicy failed: %s\n", __func__, strerror(errno));
+            } else {
+                has_policy = true;
+            }
+        }
+#else
+        (void) error;
+        LOG_WRN("%s: cpus and numa_node are only supported on Linux, ignoring them\n", __func__);
+#endif
+        return true;
+    }
+
+    ~cpu_affinity_scope() {
+#if defined(__linux__)
+        if (has_policy) {
+            syscall(SYS_set_mempolicy, saved_mode, saved_nodes, 1024 + 1);
+        }
+        if (has_saved) {
+            sched_setaffinity(0, sizeof(saved), &saved);
+        }
+#endif
+    }
+};
+
+//
+// huge pages
+//
+// ggml allocates the weights and the state buffers itself, so they can't be
+// mapped with MAP_HUGETLB from here. instead, the anonymous mappings that appear
+// while a model or a state is created are advised for transparent huge pages.
+// buffers first touched later - compute buffers, kv caches - then fault in huge
+// pages. the weights are already read in, so they are collapsed on the spot
+// where the kernel has MADV_COLLAPSE (6.1+), and left to khugepaged elsewhere.
+// with THP disabled, or off Linux, nothing is advised
+//
+
+#if defined(__linux__) && !defined(MADV_COLLAPSE)
+#define MADV_COLLAPSE 25
+#endif
+
+#define HUGE_PAGE_SIZE (2ull << 20)
+
+struct huge_page_region {
+    uintptr_t begin;
+    uintptr_t end;
+};
+
+static bool huge_pages_available() {
+#if defined(__linux__)
+    std::ifstream f("/sys/kernel/mm/transparent_hugepage/enabled");
+    std::string mode;
+    return std::getline(f, mode) && mode.find("[never]") == std::string::npos;
+#else
+    return false;
+#endif
+}
+
+// writable anonymous mappings and the heap, in address order
+static std::vector<huge_page_region> huge_pages_regions() {
+    std::vector<huge_page_region> regions;
+#if defined(__linux__)
+    FILE * f = fopen("/proc/self/maps", "r");
+    if (f == nullptr) {
+        return regions;
+    }
+
+    char line[4352];
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        unsigned long begin = 0;
+        unsigned long end   = 0;
+        unsigned long inode = 0;
+        char perms[8];
+        int  n_prefix = 0;
+        if (sscanf(line, "%lx-%lx %7s %*x %*s %lu %n", &begin, &end, perms, &inode, &n_prefix) < 4 || n_prefix == 0) {
+            continue;
+        }
+        const char * path = line + n_prefix;
+        const bool anon = inode == 0 && (path[0] == '\n' || path[0] == '\0' || strncmp(path, "[heap]", 6) == 0);
+        if (anon && perms[1] == 'w') {
+            regions.push_back({ (uintptr_t) begin, (uintptr_t) end });
+        }
+    }
+    fclose(f);
+#endif
+    return regions;
+}
+
+// advises the memory mapped since the before snapshot - new mappings, and
+// growth of old ones - and returns how many bytes were advised. collapse is
+// for memory already written, it would populate untouched buffers
+static int64_t huge_pages_advise_new(const std::vector<huge_page_region> & before, bool collapse) {
+    int64_t n_advised = 0;
+#if defined(__linux__)
+    auto advise = [&](uintptr_t begin, uintptr_t end) {
+        begin = (begin + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1);
+        end   = end & ~(uintptr_t) (HUGE_PAGE_SIZE - 1);
+        if (end <= begin || madvise((void *) begin, end - begin, MADV_HUGEPAGE) != 0) {
+            return;
+        }
+        n_advised += end - begin;
+        if (collapse) {
+            madvise((void *) begin, end - begin, MADV_COLLAPSE); // EINVAL before 6.1, best effort anyway
+        }
+    };
+
+    for (const auto & region : huge_pages_regions()) {
+        uintptr_t pos = region.begin;
+        for (const auto & old : before) {
+            if (old.end <= pos) {
+                continue;
+            }
+            if (old.begin >= region.end) {
+                break;
+            }
+            if (old.begin > pos) {
+                advise(pos, old.begin);
+            }
+            pos = std::max(pos, old.end);
+        }
+        if (pos < region.end) {
+            advise(pos, region.end);
+        }
+    }
+#else
+    (void) before;
+    (void) collapse;
+#endif
+    return n_advised;
+}
+
+// anonymous memory of the process actually backed by huge pages
+static int64_t huge_pages_backed_bytes() {
+#if defined(__linux__)
+    FILE * f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == nullptr) {
+        return 0;
+    }
+    char line[256];
+    long long kb = 0;
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        if (sscanf(line, "AnonHugePages: %lld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb*1024;
+#else
+    return 0;
+#endif
+}
+
+json whisper_metrics_to_json(const whisper_timings & timings, int n_tokens, int64_t n_samples, int64_t t_full_us) {
+    const float audio_ms   = 1000.0f*n_samples/WHISPER_SAMPLE_RATE;
+    const float process_ms = t_full_us/1000.0f;
+
+    json metrics;
+    metrics["load_ms"]           = timings.load_ms;
+    metrics["quantize_ms"]       = timings.quantize_ms;
+    metrics["mel_ms"]            = timings.mel_ms;
+    metrics["sample_ms"]         = timings.sample.ms;
+    metrics["encode_ms"]         = timings.encode.ms;
+    metrics["decode_ms"]         = timings.decode.ms;
+    metrics["batchd_ms"]         = timings.batchd.ms;
+    metrics["prompt_ms"]         = timings.prompt.ms;
+    metrics["sample_runs"]       = timings.sample.runs;
+    metrics["encode_runs"]       = timings.encode.runs;
+    metrics["decode_runs"]       = timings.decode.runs;
+    metrics["batchd_runs"]       = timings.batchd.runs;
+    metrics["prompt_runs"]       = timings.prompt.runs;
+    metrics["tokens"]            = n_tokens;
+    metrics["fallbacks_logprob"] = timings.fallbacks_p;
+    metrics["fallbacks_entropy"] = timings.fallbacks_h;
+    metrics["audio_ms"]          = audio_ms;
+    metrics["process_ms"]        = process_ms;
+    metrics["rtf"]               = audio_ms > 0.0f ? process_ms/audio_ms : 0.0f;
+    metrics["peak_rss_bytes"]    = peak_rss_bytes();
+    return metrics;
+}
+
+char *jsonToChar(json jsonData) {
+    std::string result = jsonData.dump(-1, ' ', false, json::error_handler_t::ignore);
+    char *ch = new char[result.size() + 1];
+    strcpy(ch, result.c_str());
+    return ch;
+}
+
+//  500 -> 00:05.000
+// 6000 -> 01:00.000
+std::string to_timestamp(int64_t t, bool comma = false) {
+    int64_t msec = t * 10;
+    int64_t hr = msec / (1000 * 60 * 60);
+    msec = msec - hr * (1000 * 60 * 60);
+    int64_t min = msec / (1000 * 60);
+    msec = msec - min * (1000 * 60);
+    int64_t sec = msec / 1000;
+    msec = msec - sec * 1000;
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+
+    return std::string(buf);
+}
+
+int timestamp_to_sample(int64_t t, int n_samples) {
+    return std::max(0, std::min((int) n_samples - 1, (int) ((t*WHISPER_SAMPLE_RATE)/100)));
+}
+
+std::string estimate_diarization_speaker(const std::pmr::vector<whisper_pcm_samples> & pcm_stereo, int64_t t0, int64_t t1, bool id_only = false) {
+    std::string speaker = "";
+    const int64_t n_samples = pcm_stereo[0].size();
+
+    const int64_t is0 = timestamp_to_sample(t0, n_samples);
+    const int64_t is1 = timestamp_to_sample(t1, n_samples);
+
+    double energy0 = 0.0f;
+    double energy1 = 0.0f;
+
+    for (int64_t j = is0; j < is1; j++) {
+        energy0 += fabs(pcm_stereo[0][j]);
+        energy1 += fabs(pcm_stereo[1][j]);
+    }
+
+    if (energy0 > 1.1*energy1) {
+        speaker = "0";
+    } else if (energy1 > 1.1*energy0) {
+        speaker = "1";
+    } else {
+        speaker = "?";
+    }
+
+    //printf("is0 = %lld, is1 = %lld, energy0 = %f, energy1 = %f, speaker = %s\n", is0, is1, energy0, energy1, speaker.c_str());
+
+    if (!id_only) {
+        speaker.insert(0, "(speaker ");
+        speaker.append(")");
+    }
+
+    return speaker;
+}
+
+//
+// subtitle output
+//
+// segments are appended to the files as they are decoded, straight into each
+// file's stdio buffer, so the transcript is never assembled in memory a second
+// time and a finished job leaves complete files behind
+//
+
+enum whisper_output_format {
+    WHISPER_OUTPUT_TXT,
+    WHISPER_OUTPUT_SRT,
+    WHISPER_OUTPUT_VTT,
+    WHISPER_OUTPUT_LRC,
+};
+
+static const char * k_output_ext[] = { "txt", "srt", "vtt", "lrc" };
+
+static int whisper_output_format_from_str(const std::string & str) {
+    for (int i = 0; i < (int) (sizeof(k_output_ext)/sizeof(k_output_ext[0])); ++i) {
+        if (str == k_output_ext[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+struct whisper_output_file {
+    int    format = WHISPER_OUTPUT_TXT;
+    FILE * fp     = nullptr;
+
+    std::string       path;
+    std::vector<char> buf;
+};
+
+struct whisper_output_writer {
+    static constexpr size_t BUF_SIZE = 64*1024;
+
+    std::vector<whisper_output_file> files;
+
+    int n_written = 0; // segments written so far
+
+    whisper_output_writer() = default;
+    whisper_output_writer(const whisper_output_writer &) = delete;
+
+    ~whisper_output_writer() {
+        close();
+    }
+
+    // opens <fname>.<ext> for every format, returns false if one can't be created
+    bool open(const std::string & fname, const std::vector<std::string> & formats) {
+        files.reserve(formats.size());
+
+        for (const auto & name : formats) {
+            const int format = whisper_output_format_from_str(name);
+            if (format < 0 || std::any_of(files.begin(), files.end(), [&](const whisper_output_file & f) { return f.format == format; })) {
+                continue;
+            }
+
+            files.emplace_back();
+            whisper_output_file & file = files.back();
+            file.format = format;
+            file.path   = fname + "." + k_output_ext[format];
+            file.fp     = fopen(file.path.c_str(), "w");
+            if (file.fp == nullptr) {
+                LOG_ERR("%s: failed to open '%s' for writing\n", __func__, file.path.c_str());
+                files.pop_back();
+                return false;
+            }
+
+            file.buf.resize(BUF_SIZE);
+            setvbuf(file.fp, file.buf.data(), _IOFBF, file.buf.size());
+
+            if (format == WHISPER_OUTPUT_VTT) {
+                fputs("WEBVTT\n\n", file.fp);
+            } else if (format == WHISPER_OUTPUT_LRC) {
+                fputs("[by:whisper.cpp]\n", file.fp);
+            }
+        }
+
+        return true;
+    }
+
+    void write(int64_t t0, int64_t t1, const char * text, const char * speaker) {
+        n_written++;
+
+        for (auto & file : files) {
+            switch (file.format) {
+                case WHISPER_OUTPUT_TXT:
+                    fprintf(file.fp, "%s%s\n", speaker, text);
+                    break;
+                case WHISPER_OUTPUT_SRT:
+                    fprintf(file.fp, "%d\n%s --> %s\n%s%s\n\n", n_written,
+                            to_timestamp(t0, true).c_str(), to_timestamp(t1, true).c_str(), speaker, text);
+                    break;
+                case WHISPER_OUTPUT_VTT:
+                    fprintf(file.fp, "%s --> %s\n%s%s\n\n",
+                            to_timestamp(t0).c_str(), to_timestamp(t1).c_str(), speaker, text);
+                    break;
+                case WHISPER_OUTPUT_LRC:
+                    fprintf(file.fp, "[%02d:%02d.%02d]%s%s\n",
+                            (int) (t0/6000), (int) (t0/100%60), (int) (t0%100), speaker, text);
+                    break;
+            }
+        }
+    }
+
+    // returns false if buffered output couldn't be written out
+    bool close() {
+        bool ok = true;
+        for (auto & file : files) {
+            if (file.fp != nullptr && fclose(file.fp) != 0) {
+                LOG_ERR("%s: failed to write '%s'\n", __func__, file.path.c_str());
+                ok = false;
+            }
+            file.fp = nullptr;
+        }
+        return ok;
+    }
+};
+
+//
+// checkpoints
+//
+// a job with a checkpoint file journals every finished segment to it as a JSON
+// line, after a header line describing the job. a resumed job reloads the
+// segments, skips the audio they cover and continues with their last tokens as
+// the prompt. the file is removed once the job has covered all of its audio
+//
+
+struct whisper_checkpoint {
+    FILE * fp = nullptr;
+
+    std::string path;
+
+    whisper_checkpoint() = default;
+    whisper_checkpoint(const whisper_checkpoint &) = delete;
+
+    ~whisper_checkpoint() {
+        close();
+    }
+
+    // (re)writes the file with the header and the segments kept from a previous run.
+    // written aside and renamed, so a crash during the rewrite leaves the old file
+    bool create(const std::string & fname, const json & header, const std::vector<json> & segments) {
+        path = fname;
+
+        const std::string tmp = path + ".tmp";
+        fp = fopen(tmp.c_str(), "w");
+        if (fp == nullptr) {
+            LOG_ERR("%s: failed to open '%s' for writing\n", __func__, tmp.c_str());
+            return false;
+        }
+
+        write_line(header);
+        for (const auto & segment : segments) {
+            write_line(segment);
+        }
+
+        const bool ok = fflush(fp) == 0;
+        close();
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            LOG_ERR("%s: failed to write '%s'\n", __func__, path.c_str());
+            remove(tmp.c_str());
+            return false;
+        }
+
+        fp = fopen(path.c_str(), "a");
+        if (fp == nullptr) {
+            LOG_ERR("%s: failed to open '%s' for writing\n", __func__, path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // text tokens only, special tokens are not needed for the prompt
+    void append(int64_t t0, int64_t t1, const char * text, const std::string & speaker, const std::vector<whisper_token> & tokens) {
+        json segment;
+        segment["start"]   = t0;
+        segment["end"]     = t1;
+        segment["text"]    = text;
+        segment["speaker"] = speaker;
+        segment["tokens"]  = tokens;
+        write_line(segment);
+    }
+
+    // called after every batch of segments so a crash loses at most the current window
+    void flush() {
+        if (fp != nullptr) {
+            fflush(fp);
+        }
+    }
+
+    void close() {
+        if (fp != nullptr) {
+            fclose(fp);
+            fp = nullptr;
+        }
+    }
+
+    void write_line(const json & line) {
+        if (fp != nullptr) {
+            const std::string str = line.dump(-1, ' ', false, json::error_handler_t::ignore);
+            fwrite(str.data(), 1, str.size(), fp);
+            fputc('\n', fp);
+        }
+    }
+};
+
+// segments of a checkpoint written for the same job. stops at the first line that
+// doesn't parse, which is where a crash interrupted the last write
+static bool whisper_checkpoint_load(const std::string & fname, const json & header, std::vector<json> & segments) {
+    std::ifstream fin(fname);
+    if (!fin) {
+        return false;
+    }
+
+    std::string line;
+    if (!std::getline(fin, line) || json::parse(line, nullptr, false) != header) {
+        LOG_WRN("%s: '%s' was written for a different job, starting over\n", __func__, fname.c_str());
+        return false;
+    }
+
+    while (std::getline(fin, line)) {
+        json segment = json::parse(line, nullptr, false);
+        if (segment.is_discarded() || !segment["start"].is_number_integer() || !segment["end"].is_number_integer() ||
+            !segment["text"].is_string() || !segment["tokens"].is_array()) {
+            break;
+        }
+        segments.push_back(std::move(segment));
+    }
+
+    return true;
+}
+
+void whisper_print_progress_callback(struct whisper_context * /*ctx*/, struct whisper_state * state, int progress, void * user_data) {
+    {
+        whisper_processor & processor = whisper_processor_for(*(whisper_print_user_data *) user_data, state);
+        std::lock_guard<std::mutex> lock(((whisper_print_user_data *) user_data)->callback_mutex);
+        whisper_clock_on_progress(processor.clock);
+    }
+
+    const int64_t t_pass_offset = ((whisper_print_user_data *) user_data)->t_pass_offset;
+    const int64_t t_pass_len    = ((whisper_print_user_data *) user_data)->t_pass_len;
+
+    whisper_progress_tracker & tracker = ((whisper_print_user_data *) user_data)->progress;
+    whisper_progress_update(tracker, t_pass_offset - tracker.t_offset + progress*t_pass_len/100, false);
+
+    if (!((whisper_print_user_data *) user_data)->params->print_progress) {
+        return;
+    }
+
+    // whisper reports the progress of the current pass
+    if (tracker.t_total > 0) {
+        progress = (int) (100*std::min(t_pass_offset - tracker.t_offset + progress*t_pass_len/100, tracker.t_total)/tracker.t_total);
+    }
+
+    int progress_step = ((whisper_print_user_data *) user_data)->params->progress_step;
+    int * progress_prev  = &(((whisper_print_user_data *) user_data)->progress_prev);
+    if (progress >= *progress_prev + progress_step) {
+        *progress_prev += progress_step;
+        LOG_INF("%s: progress = %3d%%\n", __func__, progress);
+        ((whisper_print_user_data *) user_data)->progress_cb(progress);
+    }
+}
+
+void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
+    const auto & params  = *((whisper_print_user_data *) user_data)->params;
+    const auto & pcm_stereo = *((whisper_print_user_data *) user_data)->pcm_stereo;
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
+
+    // segment times are relative to the start of the pass
+    const int64_t t_pass_offset = ((whisper_print_user_data *) user_data)->t_pass_offset;
+
+    whisper_progress_tracker & tracker = ((whisper_print_user_data *) user_data)->progress;
+    whisper_progress_update(tracker, t_pass_offset + whisper_full_get_segment_t1_from_state(state, n_segments - 1) - tracker.t_offset, false);
+
+    whisper_output_writer * writer     = ((whisper_print_user_data *) user_data)->writer;
+    whisper_checkpoint    * checkpoint = ((whisper_print_user_data *) user_data)->checkpoint;
+    if (writer != nullptr || checkpoint != nullptr) {
+        int & n_emitted = ((whisper_print_user_data *) user_data)->n_emitted;
+
+        for (int i = n_emitted - ((whisper_print_user_data *) user_data)->n_segments_prev; i < n_segments; i++, n_emitted++) {
+            const int64_t t0 = t_pass_offset + whisper_full_get_segment_t0_from_state(state, i);
+            const int64_t t1 = t_pass_offset + whisper_full_get_segment_t1_from_state(state, i);
+            if (t1 > ((whisper_print_user_data *) user_data)->t_hold) {
+                break;
+            }
+
+            const char * text = whisper_full_get_segment_text_from_state(state, i);
+
+            const std::string speaker = params.diarize && pcm_stereo.size() == 2 ? estimate_diarization_speaker(pcm_stereo, t0, t1) : "";
+
+            if (writer != nullptr) {
+                writer->write(t0, t1, text, speaker.c_str());
+            }
+
+            if (checkpoint != nullptr) {
+                std::vector<whisper_token> tokens;
+                for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
+                    const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
+                    if (id < whisper_token_eot(ctx)) {
+                        tokens.push_back(id);
+                    }
+                }
+                checkpoint->append(t0, t1, text, speaker, tokens);
+            }
+        }
+
+        if (checkpoint != nullptr) {
+            checkpoint->flush();
+        }
+    }
+
+    if (!log_enabled(LOG_LEVEL_INFO)) {
+        return;
+    }
+
+    std::string speaker = "";
+
+    int64_t t0 = 0;
+    int64_t t1 = 0;
+
+    // print the last n_new segments
+    const int s0 = n_segments - n_new;
+
+    if (s0 == 0) {
+        LOG_INF("\n");
+    }
+
+    for (int i = s0; i < n_segments; i++) {
+        if (t_pass_offset + whisper_full_get_segment_t1_from_state(state, i) > ((whisper_print_user_data *) user_data)->t_hold) {
+            break;
+        }
+
+        if (!params.no_timestamps || params.diarize) {
+            t0 = t_pass_offset + whisper_full_get_segment_t0_from_state(state, i);
+            t1 = t_pass_offset + whisper_full_get_segment_t1_from_state(state, i);
+        }
+
+        if (params.diarize && pcm_stereo.size() == 2) {
+            speaker = estimate_diarization_speaker(pcm_stereo, t0, t1);
+        }
+
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
+
+        const bool speaker_turn = params.tinydiarize && whisper_full_get_segment_speaker_turn_next_from_state(state, i);
+
+        // with timestamps or speakers: each segment on new line
+        const bool newline = !params.no_timestamps || params.diarize;
+
+        if (!params.no_timestamps) {
+            LOG_INF("[%s --> %s]  %s%s%s%s", to_timestamp(t0).c_str(), to_timestamp(t1).c_str(),
+                    speaker.c_str(), text, speaker_turn ? params.tdrz_speaker_turn.c_str() : "", newline ? "\n" : "");
+        } else {
+            LOG_INF("%s%s%s%s", speaker.c_str(), text, speaker_turn ? params.tdrz_speaker_turn.c_str() : "", newline ? "\n" : "");
+        }
+    }
+}
+
+//
+// host tuning
+//
+// the autotune request benchmarks thread and processor counts on the host and
+// saves the fastest combination to a JSON file. requests start from it instead
+// of the built-in defaults, so it applies wherever "threads" and "processors"
+// are not given. the file is read on the first request, and ignored when it was
+// written for a different cpu topology
+//
+
+struct whisper_autotune_config {
+    std::mutex mutex;
+
+    bool        loaded   = false;
+    bool        has_path = false; // set with autotune_set_path()
+    std::string path;             // empty: not persisted
+
+    int32_t n_threads    = 0; // 0: not tuned
+    int32_t n_processors = 0;
+};
+
+static whisper_autotune_config g_autotune;
+
+static std::string whisper_autotune_default_path() {
+#if defined(_WIN32)
+    const char * dir = getenv("APPDATA");
+    return dir != nullptr ? std::string(dir) + "\\media-podium-whisper.autotune.json" : "";
+#else
+    const char * dir = getenv("XDG_CONFIG_HOME");
+    if (dir != nullptr && dir[0] != '\0') {
+        return std::string(dir) + "/media-podium-whisper.autotune.json";
+    }
+    const char * home = getenv("HOME");
+    return home != nullptr ? std::string(home) + "/.config/media-podium-whisper.autotune.json" : "";
+#endif
+}
+
+// must be called with g_autotune.mutex held
+static void whisper_autotune_load_locked() {
+    if (g_autotune.loaded) {
+        return;
+    }
+    g_autotune.loaded = true;
+
+    if (!g_autotune.has_path) {
+        g_autotune.path = whisper_autotune_default_path();
+    }
+    if (g_autotune.path.empty()) {
+        return;
+    }
+
+    std::ifstream f(g_autotune.path);
+    if (!f) {
+        return;
+    }
+
+    const json config = json::parse(f, nullptr, false);
+    if (!config.is_object()) {
+        LOG_WRN("%s: ignoring malformed '%s'\n", __func__, g_autotune.path.c_str());
+        return;
+    }
+
+    const cpu_topology topology = cpu_topology_get();
+    if (config.value("n_logical", 0) != topology.n_logical || config.value("n_physical", 0) != topology.n_physical) {
+        LOG_WRN("%s: ignoring '%s', it was tuned for another cpu topology\n", __func__, g_autotune.path.c_str());
+        return;
+    }
+
+    const int32_t n_threads    = config.value("threads", 0);
+    const int32_t n_processors = config.value("processors", 0);
+    if (n_threads > 0 && n_processors > 0) {
+        g_autotune.n_threads    = n_threads;
+        g_autotune.n_processors = n_processors;
+    }
+}
+
+static void whisper_autotune_defaults(whisper_params & params) {
+    std::lock_guard<std::mutex> lock(g_autotune.mutex);
+    whisper_autotune_load_locked();
+
+    if (g_autotune.n_threads > 0) {
+        params.n_threads    = g_autotune.n_threads;
+        params.n_processors = g_autotune.n_processors;
+    }
+}
+
+// takes effect for the requests that follow; returns false when the file can't be written
+static bool whisper_autotune_save(const json & config) {
+    std::lock_guard<std::mutex> lock(g_autotune.mutex);
+    whisper_autotune_load_locked();
+
+    g_autotune.n_threads    = config["threads"].get<int32_t>();
+    g_autotune.n_processors = config["processors"].get<int32_t>();
+
+    if (g_autotune.path.empty()) {
+        return false;
+    }
+
+#if !defined(_WIN32)
+    // the default path is in ~/.config, which may not exist yet
+    const size_t slash = g_autotune.path.rfind('/');
+    if (slash != std::string::npos && slash > 0) {
+        mkdir(g_autotune.path.substr(0, slash).c_str(), 0755);
+    }
+#endif
+
+    // written aside and renamed, so a reader never sees half a file
+    const std::string tmp = g_autotune.path + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::trunc);
+        if (!(f << config.dump(2) << "\n")) {
+            return false;
+        }
+    }
+    if (rename(tmp.c_str(), g_autotune.path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+//
+// request parsing
+//
+// requests are read in one pass by a SAX reader that writes straight into a
+// whisper_request, so no json DOM is built for them. the accepted keys are the
+// entries of k_request_fields, kept sorted for a binary search; unknown keys and
+// values of the wrong type fail the request with the key in the message. null
+// leaves a field at its default
+//
+// a request may name a preset: a stored request whose fields are the defaults,
+// with the fields given in the request copied over it. presets are parsed once,
+// when they are registered, and not on every request
+//
+
+struct whisper_request {
+    std::string type;
+
+    whisper_params params;
+
+    std::vector<std::string> files; // transcribeBatch
+
+    bool has_threads = false; // transcribeBatch splits the cores between jobs unless set
+    bool warmup      = true;  // loadModel
+
+    std::string preset;
+
+    uint64_t fields = 0; // bit i: k_request_fields[i] was given
+
+    whisper_request() {
+        params.print_progress = true;
+    }
+};
+
+enum request_value_type {
+    REQUEST_VALUE_INT,
+    REQUEST_VALUE_FLOAT, // integers are accepted too
+    REQUEST_VALUE_BOOL,
+    REQUEST_VALUE_STRING,
+    REQUEST_VALUE_STRINGS,
+};
+
+static const char * k_request_value_type_str[] = {
+    "an integer", "a number", "a boolean", "a string", "an array of strings",
+};
+
+struct request_value {
+    int64_t     i = 0;
+    double      f = 0.0;
+    bool        b = false;
+    std::string s;
+    std::vector<std::string> strs;
+};
+
+// on failure the setter leaves the reason in error, without the key
+typedef bool (*request_field_setter)(whisper_request & request, request_value & value, std::string & error);
+
+// copies the field from src to dst, to lay a request over a preset
+typedef void (*request_field_copier)(whisper_request & dst, const whisper_request & src);
+
+struct request_field {
+    const char *         key;
+    request_value_type   type;
+    request_field_setter set;
+    request_field_copier copy;
+};
+
+template <int32_t whisper_params::* M>
+static bool request_set_i32(whisper_request & request, request_value & value, std::string & error) {
+    if (value.i < INT32_MIN || value.i > INT32_MAX) {
+        error = "is out of range";
+        return false;
+    }
+    request.params.*M = (int32_t) value.i;
+    return true;
+}
+
+template <float whisper_params::* M>
+static bool request_set_f32(whisper_request & request, request_value & value, std::string & /*error*/) {
+    request.params.*M = (float) value.f;
+    return true;
+}
+
+template <bool whisper_params::* M>
+static bool request_set_bool(whisper_request & request, request_value & value, std::string & /*error*/) {
+    request.params.*M = value.b;
+    return true;
+}
+
+template <std::string whisper_params::* M>
+static bool request_set_str(whisper_request & request, request_value & value, std::string & /*error*/) {
+    request.params.*M = std::move(value.s);
+    return true;
+}
+
+static bool request_set_type(whisper_request & request, request_value & value, std::string & /*error*/) {
+    request.type = std::move(value.s);
+    return true;
+}
+
+static bool request_set_file(whisper_request & request, request_value & value, std::string & /*error*/) {
+    request.params.fname_inp.assign(1, std::move(value.s));
+    return true;
+}
+
+static bool request_set_files(whisper_request & request, request_value & value, std::string & /*error*/) {
+    request.files = std::move(value.strs);
+    return true;
+}
+
+static bool request_set_output(whisper_request & request, request_value & value, std::string & /*error*/) {
+    request.params.output_formats = std::move(value.strs);
+    return true;
+}
+
+static bool request_set_output_file(whisper_request & request, request_value & value, std::string & /*error*/) {
+    request.params.fname_out.assign(1, std::move(value.s));
+    return true;
+}
+
+static bool request_set_log_level(whisper_request & request, request_value & value, std::string & error) {
+    const int level = log_level_from_str(value.s);
+    if (level < 0) {
+        error = "must be one of none, error, warn, info or debug";
+        return false;
+    }
+    request.params.log_level = level;
+    return true;
+}
+
+static bool request_set_pcm_format(whisper_request & request, request_value & value, std::string & error) {
+    const int format = whisper_pcm_format_from_str(value.s);
+    if (format < 0) {
+        error = "must be one of f32, f16 or s16";
+        return false;
+    }
+    request.params.pcm_format = format;
+    return true;
+}
+
+static bool request_set_threads(whisper_request & request, request_value & value, std::string & error) {
+    request.has_threads = true;
+    return request_set_i32<&whisper_params::n_threads>(request, value, error);
+}
+
+static bool request_set_warmup(whisper_request & request, request_value & value, std::string & /*error*/) {
+    request.warmup = value.b;
+    return true;
+}
+
+static bool request_set_preset(whisper_request & request, request_value & value, std::string & /*error*/) {
+    request.preset = std::move(value.s);
+    return true;
+}
+
+template <auto M>
+static void request_copy(whisper_request & dst, const whisper_request & src) {
+    dst.params.*M = src.params.*M;
+}
+
+static void request_copy_type(whisper_request & dst, const whisper_request & src) {
+    dst.type = src.type;
+}
+
+static void request_copy_files(whisper_request & dst, const whisper_request & src) {
+    dst.files = src.files;
+}
+
+static void request_copy_threads(whisper_request & dst, const whisper_request & src) {
+    dst.params.n_threads = src.params.n_threads;
+    dst.has_threads      = true;
+}
+
+static void request_copy_warmup(whisper_request & dst, const whisper_request & src) {
+    dst.warmup = src.warmup;
+}
+
+static void request_copy_preset(whisper_request & dst, const whisper_request & src) {
+    dst.preset = src.preset;
+}
+
+// sorted by key (strcmp order)
+static constexpr request_field k_request_fields[] = {
+    { "@type",                REQUEST_VALUE_STRING,  request_set_type,                                         request_copy_type },
+    { "beam-size",            REQUEST_VALUE_INT,     request_set_i32<&whisper_params::beam_size>,              request_copy<&whisper_params::beam_size> },
+    { "best-of",              REQUEST_VALUE_INT,     request_set_i32<&whisper_params::best_of>,                request_copy<&whisper_params::best_of> },
+    { "checkpoint",           REQUEST_VALUE_STRING,  request_set_str<&whisper_params::checkpoint>,             request_copy<&whisper_params::checkpoint> },
+    { "cpus",                 REQUEST_VALUE_STRING,  request_set_str<&whisper_params::cpus>,                   request_copy<&whisper_params::cpus> },
+    { "deadline_ms",          REQUEST_VALUE_INT,     request_set_i32<&whisper_params::deadline_ms>,            request_copy<&whisper_params::deadline_ms> },
+    { "diarize",              REQUEST_VALUE_BOOL,    request_set_bool<&whisper_params::diarize>,               request_copy<&whisper_params::diarize> },
+    { "draft_model",          REQUEST_VALUE_STRING,  request_set_str<&whisper_params::draft_model>,            request_copy<&whisper_params::draft_model> },
+    { "duration",             REQUEST_VALUE_INT,     request_set_i32<&whisper_params::duration_ms>,            request_copy<&whisper_params::duration_ms> },
+    { "entropy-thold",        REQUEST_VALUE_FLOAT,   request_set_f32<&whisper_params::entropy_thold>,          request_copy<&whisper_params::entropy_thold> },
+    { "fallback_deadline_ms", REQUEST_VALUE_INT,     request_set_i32<&whisper_params::fallback_deadline_ms>,   request_copy<&whisper_params::fallback_deadline_ms> },
+    { "fallback_max_total",   REQUEST_VALUE_INT,     request_set_i32<&whisper_params::fallback_max_total>,     request_copy<&whisper_params::fallback_max_total> },
+    { "fallback_max_window",  REQUEST_VALUE_INT,     request_set_i32<&whisper_params::fallback_max_window>,    request_copy<&whisper_params::fallback_max_window> },
+    { "file",                 REQUEST_VALUE_STRING,  request_set_file,                                         request_copy<&whisper_params::fname_inp> },
+    { "files",                REQUEST_VALUE_STRINGS, request_set_files,                                        request_copy_files },
+    { "huge_pages",           REQUEST_VALUE_BOOL,    request_set_bool<&whisper_params::huge_pages>,            request_copy<&whisper_params::huge_pages> },
+    { "language",             REQUEST_VALUE_STRING,  request_set_str<&whisper_params::language>,               request_copy<&whisper_params::language> },
+    { "log_level",            REQUEST_VALUE_STRING,  request_set_log_level,                                    request_copy<&whisper_params::log_level> },
+    { "logprob-thold",        REQUEST_VALUE_FLOAT,   request_set_f32<&whisper_params::logprob_thold>,          request_copy<&whisper_params::logprob_thold> },
+    { "max-context",          REQUEST_VALUE_INT,     request_set_i32<&whisper_params::max_context>,            request_copy<&whisper_params::max_context> },
+    { "max-len",              REQUEST_VALUE_INT,     request_set_i32<&whisper_params::max_len>,                request_copy<&whisper_params::max_len> },
+    { "model",                REQUEST_VALUE_STRING,  request_set_str<&whisper_params::model>,                  request_copy<&whisper_params::model> },
+    { "no-fallback",          REQUEST_VALUE_BOOL,    request_set_bool<&whisper_params::no_fallback>,           request_copy<&whisper_params::no_fallback> },
+    { "numa_node",            REQUEST_VALUE_INT,     request_set_i32<&whisper_params::numa_node>,              request_copy<&whisper_params::numa_node> },
+    { "offset-n",             REQUEST_VALUE_INT,     request_set_i32<&whisper_params::offset_n>,               request_copy<&whisper_params::offset_n> },
+    { "offset-t",             REQUEST_VALUE_INT,     request_set_i32<&whisper_params::offset_t_ms>,            request_copy<&whisper_params::offset_t_ms> },
+    { "output",               REQUEST_VALUE_STRINGS, request_set_output,                                       request_copy<&whisper_params::output_formats> },
+    { "output_file",          REQUEST_VALUE_STRING,  request_set_output_file,                                  request_copy<&whisper_params::fname_out> },
+    { "ov-e-device",          REQUEST_VALUE_STRING,  request_set_str<&whisper_params::openvino_encode_device>, request_copy<&whisper_params::openvino_encode_device> },
+    { "parallel",             REQUEST_VALUE_INT,     request_set_i32<&whisper_params::parallel>,               request_copy<&whisper_params::parallel> },
+    { "pcm_format",           REQUEST_VALUE_STRING,  request_set_pcm_format,                                   request_copy<&whisper_params::pcm_format> },
+    { "preset",               REQUEST_VALUE_STRING,  request_set_preset,                                       request_copy_preset },
+    { "processors",           REQUEST_VALUE_INT,     request_set_i32<&whisper_params::n_processors>,           request_copy<&whisper_params::n_processors> },
+    { "progress_interval_ms", REQUEST_VALUE_INT,     request_set_i32<&whisper_params::progress_interval_ms>,   request_copy<&whisper_params::progress_interval_ms> },
+    { "prompt",               REQUEST_VALUE_STRING,  request_set_str<&whisper_params::prompt>,                 request_copy<&whisper_params::prompt> },
+    { "quantize",             REQUEST_VALUE_STRING,  request_set_str<&whisper_params::quantize>,               request_copy<&whisper_params::quantize> },
+    { "quantize_save",        REQUEST_VALUE_BOOL,    request_set_bool<&whisper_params::quantize_save>,         request_copy<&whisper_params::quantize_save> },
+    { "resume",               REQUEST_VALUE_BOOL,    request_set_bool<&whisper_params::resume>,                request_copy<&whisper_params::resume> },
+    { "speed-up",             REQUEST_VALUE_BOOL,    request_set_bool<&whisper_params::speed_up>,              request_copy<&whisper_params::speed_up> },
+    { "split-on-word",        REQUEST_VALUE_BOOL,    request_set_bool<&whisper_params::split_on_word>,         request_copy<&whisper_params::split_on_word> },
+    { "threads",              REQUEST_VALUE_INT,     request_set_threads,                                      request_copy_threads },
+    { "tinydiarize",          REQUEST_VALUE_BOOL,    request_set_bool<&whisper_params::tinydiarize>,           request_copy<&whisper_params::tinydiarize> },
+    { "token_data",           REQUEST_VALUE_BOOL,    request_set_bool<&whisper_params::token_data>,            request_copy<&whisper_params::token_data> },
+    { "translate",            REQUEST_VALUE_BOOL,    request_set_bool<&whisper_params::translate>,             request_copy<&whisper_params::translate> },
+    { "use_gpu",              REQUEST_VALUE_BOOL,    request_set_bool<&whisper_params::use_gpu>,               request_copy<&whisper_params::use_gpu> },
+    { "warmup",               REQUEST_VALUE_BOOL,    request_set_warmup,                                       request_copy_warmup },
+    { "word-thold",           REQUEST_VALUE_FLOAT,   request_set_f32<&whisper_params::word_thold>,             request_copy<&whisper_params::word_thold> },
+    { "word_timestamps",      REQUEST_VALUE_BOOL,    request_set_bool<&whisper_params::word_timestamps>,       request_copy<&whisper_params::word_timestamps> },
+};
+
+static constexpr int request_key_cmp(const char * a, const char * b) {
+    while (*a != '\0' && *a == *b) {
+        ++a;
+        ++b;
+    }
+    return (unsigned char) *a - (unsigned char) *b;
+}
+
+static constexpr bool request_fields_sorted() {
+    for (size_t i = 1; i < std::size(k_request_fields); ++i) {
+        if (request_key_cmp(k_request_fields[i - 1].key, k_request_fields[i].key) >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(request_fields_sorted(), "k_request_fields must be sorted by key");
+static_assert(std::size(k_request_fields) <= 64, "whisper_request::fields has a bit per field");
+
+static const request_field * request_field_find(const std::string & key) {
+    const request_field * end = std::end(k_request_fields);
+    const request_field * it  = std::lower_bound(std::begin(k_request_fields), end, key,
+        [](const request_field & field, const std::string & k) { return strcmp(field.key, k.c_str()) < 0; });
+    return it != end && key == it->key ? it : nullptr;
+}
+
+// runs the field's setter, prefixing a failure with the key
+static bool request_field_set(const request_field & field, whisper_request & request, request_value & value, std::string & error) {
+    if (!field.set(request, value, error)) {
+        error = std::string("field '") + field.key + "' " + error;
+        return false;
+    }
+    request.fields |= 1ull << (&field - k_request_fields);
+    return true;
+}
+
+static bool request_field_given(const whisper_request & request, const char * key) {
+    return request.fields & (1ull << (request_field_find(key) - k_request_fields));
+}
+
+struct whisper_preset_registry {
+    std::mutex mutex;
+    std::map<std::string, whisper_request> presets;
+
+    whisper_preset_registry();
+};
+
+// marks fields a built-in preset sets as given, so that the process-wide defaults
+// don't replace them
+static void request_field_mark(whisper_request & request, std::initializer_list<const char *> keys) {
+    for (const char * key : keys) {
+        request.fields |= 1ull << (request_field_find(key) - k_request_fields);
+    }
+}
+
+// has_threads stays false, so transcribeBatch still splits the cores between its jobs
+whisper_preset_registry::whisper_preset_registry() {
+    const int32_t n_cores = std::max(1, (int32_t) std::thread::hardware_concurrency());
+
+    // greedy decoding on every core
+    whisper_request & fast = presets["fast-cpu"];
+    fast.params.n_threads    = n_cores;
+    fast.params.n_processors = 1;
+    fast.params.beam_size    = 1;
+    fast.params.best_of      = 1;
+    request_field_mark(fast, { "threads", "processors", "beam-size", "best-of" });
+
+    // beam search, with the full temperature fallback
+    whisper_request & accurate = presets["accurate"];
+    accurate.params.n_threads    = std::min(8, n_cores);
+    accurate.params.n_processors = 1;
+    accurate.params.beam_size    = 5;
+    accurate.params.best_of      = 5;
+    request_field_mark(accurate, { "threads", "processors", "beam-size", "best-of" });
+
+    // lowest latency: greedy, no fallback and no text carried between windows
+    whisper_request & realtime = presets["realtime"];
+    realtime.params.n_threads            = n_cores;
+    realtime.params.n_processors         = 1;
+    realtime.params.beam_size            = 1;
+    realtime.params.best_of              = 1;
+    realtime.params.no_fallback          = true;
+    realtime.params.max_context          = 0;
+    realtime.params.progress_interval_ms = 100;
+    request_field_mark(realtime, { "threads", "processors", "beam-size", "best-of", "no-fallback", "max-context", "progress_interval_ms" });
+}
+
+static whisper_preset_registry g_presets;
+
+// replaces request with its preset, overridden by the fields the request gave
+static bool whisper_request_apply_preset(whisper_request & request, std::string & error) {
+    if (request.preset.empty()) {
+        return true;
+    }
+
+    whisper_request merged;
+    {
+        std::lock_guard<std::mutex> lock(g_presets.mutex);
+        auto it = g_presets.presets.find(request.preset);
+        if (it == g_presets.presets.end()) {
+            error = "unknown preset '" + request.preset + "'";
+            return false;
+        }
+        merged = it->second;
+    }
+
+    for (size_t i = 0; i < std::size(k_request_fields); ++i) {
+        if (request.fields & (1ull << i)) {
+            k_request_fields[i].copy(merged, request);
+        }
+    }
+    merged.fields |= request.fields;
+
+    request = std::move(merged);
+    return true;
+}
+
+// "parallel" of the requests that don't give it, see set_default_parallel()
+static std::atomic<int32_t> g_parallel_default{1};
+
+// process-wide defaults, for the fields that neither the request nor its preset set.
+// a preset keeps the fields its body gave, so it picks up defaults changed after it
+// was registered
+static void whisper_request_apply_defaults(whisper_request & request) {
+    whisper_params defaults;
+    whisper_autotune_defaults(defaults);
+    cpu_affinity_defaults_apply(defaults);
+
+    if (!request_field_given(request, "threads")) {
+        request.params.n_threads = defaults.n_threads;
+    }
+    if (!request_field_given(request, "processors")) {
+        request.params.n_processors = defaults.n_processors;
+    }
+
+    if (!request_field_given(request, "cpus")) {
+        request.params.cpus = defaults.cpus;
+    }
+    if (!request_field_given(request, "numa_node")) {
+        request.params.numa_node = defaults.numa_node;
+    }
+
+    if (!request_field_given(request, "parallel")) {
+        request.params.parallel = g_parallel_default.load(std::memory_order_relaxed);
+    }
+}
+
+static std::string request_field_type_error(const request_field & field) {
+    return std::string("field '") + field.key + "' must be " + k_request_value_type_str[field.type];
+}
+
+// only a flat object is accepted: the values are scalars, or strings in an array
+struct request_sax : nlohmann::json_sax<json> {
+    whisper_request & request;
+    std::string     & error;
+
+    const request_field * field = nullptr;
+
+    int  depth    = 0;
+    bool in_array = false;
+
+    request_value value;
+
+    request_sax(whisper_request & request, std::string & error) : request(request), error(error) {}
+
+    bool fail(std::string message) {
+        if (error.empty()) {
+            error = std::move(message);
+        }
+        return false;
+    }
+
+    bool fail_type() {
+        if (depth == 0) {
+            return fail("request must be a JSON object");
+        }
+        return fail(request_field_type_error(*field));
+    }
+
+    bool set() {
+        return request_field_set(*field, request, value, error);
+    }
+
+    bool null() override {
+        if (depth == 0 || in_array) {
+            return fail_type();
+        }
+        return true;
+    }
+
+    bool boolean(bool val) override {
+        if (depth == 0 || in_array || field->type != REQUEST_VALUE_BOOL) {
+            return fail_type();
+        }
+        value.b = val;
+        return set();
+    }
+
+    bool number_integer(number_integer_t val) override {
+        if (depth == 0 || in_array) {
+            return fail_type();
+        }
+        if (field->type == REQUEST_VALUE_INT) {
+            value.i = val;
+            return set();
+        }
+        if (field->type == REQUEST_VALUE_FLOAT) {
+            value.f = (double) val;
+            return set();
+        }
+        return fail_type();
+    }
+
+    bool number_unsigned(number_unsigned_t val) override {
+        if (val > (number_unsigned_t) INT64_MAX) {
+            if (depth != 0 && !in_array && field->type == REQUEST_VALUE_INT) {
+                return fail(std::string("field '") + field->key + "' is out of range");
+            }
+            return number_float((number_float_t) val, "");
+        }
+        return number_integer((number_integer_t) val);
+    }
+
+    bool number_float(number_float_t val, const string_t & /*s*/) override {
+        if (depth == 0 || in_array || field->type != REQUEST_VALUE_FLOAT) {
+            return fail_type();
+        }
+        value.f = val;
+        return set();
+    }
+
+    bool string(string_t & val) override {
+        if (depth == 0) {
+            return fail_type();
+        }
+        if (in_array) {
+            value.strs.push_back(std::move(val));
+            return true;
+        }
+        if (field->type != REQUEST_VALUE_STRING) {
+            return fail_type();
+        }
+        value.s = std::move(val);
+        return set();
+    }
+
+    bool binary(binary_t & /*val*/) override {
+        return fail_type();
+    }
+
+    bool start_object(std::size_t /*elements*/) override {
+        if (depth != 0) {
+            return fail_type();
+        }
+        depth = 1;
+        return true;
+    }
+
+    bool key(string_t & val) override {
+        field = request_field_find(val);
+        if (field == nullptr) {
+            return fail("unknown field '" + val + "'");
+        }
+        return true;
+    }
+
+    bool end_object() override {
+        depth = 0;
+        return true;
+    }
+
+    bool start_array(std::size_t /*elements*/) override {
+        if (depth == 0 || in_array || field->type != REQUEST_VALUE_STRINGS) {
+            return fail_type();
+        }
+        in_array = true;
+        value.strs.clear();
+        return true;
+    }
+
+    bool end_array() override {
+        in_array = false;
+        return set();
+    }
+
+    bool parse_error(std::size_t /*position*/, const std::string & /*last_token*/, const nlohmann::detail::exception & ex) override {
+        return fail(std::string("invalid JSON: ") + ex.what());
+    }
+};
+
+static bool whisper_request_parse(const char * text, size_t size, whisper_request & request, std::string & error) {
+    request_sax sax(request, error);
+    if (!json::sax_parse(text, text + size, &sax)) {
+        if (error.empty()) {
+            error = "invalid request";
+        }
+        return false;
+    }
+    if (!whisper_request_apply_preset(request, error)) {
+        return false;
+    }
+    whisper_request_apply_defaults(request);
+    return true;
+}
+
+//
+// model cache
+//
+// contexts stay loaded between jobs. the weights are shared, but every running
+// job needs its own whisper state (kv caches, compute buffers, results). a job
+// gets the context's own state when it is free - the only one
+// whisper_full_parallel() can run on - and otherwise a state from a per-model
+// pool that grows up to the job's "parallel" setting. beyond that, jobs wait
+// for a state to be returned - that wait is what the queue wait histogram
+// measures.
+//
+// with a memory budget set, idle contexts are evicted least-recently-used first
+// whenever the resident total would exceed it. contexts with an active or waiting
+// job are never evicted, so the budget can be exceeded while they run
+//
+
+struct whisper_model_entry {
+    std::string key;
+    std::string path;
+    bool        use_gpu   = true;
+    int         numa_node = -1; // the node this copy was loaded for
+
+    std::mutex              mutex; // guards loading and the state pool
+    std::condition_variable state_cv;
+
+    struct whisper_context * ctx = nullptr;
+
+    bool ctx_state_busy = false;
+    std::vector<struct whisper_state *> states;      // pooled, in addition to the context's own
+    std::vector<struct whisper_state *> free_states;
+
+    float load_ms = 0.0f;
+
+    bool huge_pages = false; // the weights and states were advised for huge pages
+
+    // guarded by whisper_model_cache::mutex
+    int64_t size_bytes       = 0; // > 0 once resident
+    int64_t huge_pages_bytes = 0; // advised
+    int64_t t_last_used_us = 0;
+    int     n_active       = 0; // leases holding or waiting for the context
+};
+
+struct whisper_model_cache {
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<whisper_model_entry>> entries;
+
+    int64_t budget_bytes = 0; // 0 = unlimited
+
+    // loads are serialized so the resident set delta can be attributed to one model
+    std::mutex load_mutex;
+};
+
+static whisper_model_cache g_models;
+
+// must be called with g_models.mutex held
+static void whisper_model_evict_locked(int64_t n_reserve, const whisper_model_entry * keep) {
+    if (g_models.budget_bytes <= 0) {
+        return;
+    }
+
+    int64_t resident = n_reserve;
+    for (const auto & it : g_models.entries) {
+        resident += it.second->size_bytes;
+    }
+
+    while (resident > g_models.budget_bytes) {
+        auto lru = g_models.entries.end();
+        for (auto it = g_models.entries.begin(); it != g_models.entries.end(); ++it) {
+            const whisper_model_entry & entry = *it->second;
+            if (entry.size_bytes == 0 || entry.n_active > 0 || &entry == keep) {
+                continue;
+            }
+            if (lru == g_models.entries.end() || entry.t_last_used_us < lru->second->t_last_used_us) {
+                lru = it;
+            }
+        }
+
+        if (lru == g_models.entries.end()) {
+            LOG_WRN("%s: %lld bytes resident exceeds the budget of %lld bytes, no idle model to evict\n",
+                    __func__, (long long) resident, (long long) g_models.budget_bytes);
+            break;
+        }
+
+        whisper_model_entry & entry = *lru->second;
+        LOG_INF("%s: evicting '%s' (%lld bytes)\n", __func__, entry.path.c_str(), (long long) entry.size_bytes);
+
+        for (struct whisper_state * state : entry.states) {
+            whisper_free_state(state);
+        }
+        entry.states.clear();
+        entry.free_states.clear();
+
+        whisper_free(entry.ctx);
+        entry.ctx = nullptr;
+        resident -= entry.size_bytes;
+        entry.size_bytes = 0;
+        g_models.entries.erase(lru);
+    }
+}
+
+struct whisper_model_lease {
+    std::shared_ptr<whisper_model_entry> entry;
+
+    struct whisper_context * ctx   = nullptr;
+    struct whisper_state   * state = nullptr; // nullptr: the context's own state
+
+    bool    loaded    = false; // this lease loaded the model
+    int64_t t_wait_us = 0;     // time spent waiting for another job to load the model or return a state
+    int64_t t_load_us = 0;
+    int64_t t_quantize_us = 0;
+
+    whisper_model_lease() = default;
+    whisper_model_lease(const whisper_model_lease &) = delete;
+
+    ~whisper_model_lease() {
+        release();
+    }
+
+    void release() {
+        if (entry == nullptr) {
+            return;
+        }
+
+        if (ctx != nullptr) {
+            std::lock_guard<std::mutex> lock(entry->mutex);
+            if (state == nullptr) {
+                entry->ctx_state_busy = false;
+            } else {
+                entry->free_states.push_back(state);
+            }
+            entry->state_cv.notify_one();
+        }
+
+        std::lock_guard<std::mutex> guard(g_models.mutex);
+        entry->t_last_used_us = time_us();
+        entry->n_active--;
+        entry.reset();
+        ctx   = nullptr;
+        state = nullptr;
+    }
+};
+
+static std::string whisper_model_key(const whisper_params & params) {
+    return params.model + (params.quantize.empty() ? "" : "|" + params.quantize) + (params.use_gpu ? "|gpu" : "|cpu");
+}
+
+//
+// load-time quantization
+//
+// same conversion as whisper.cpp's examples/quantize. the result is written next
+// to the original as <name>-<type>.bin and reused while it is newer than the
+// source, or to a temporary file that is removed once loaded
+//
+
+static ggml_ftype whisper_quantize_ftype(const std::string & name) {
+    if (name == "q4_0") { return GGML_FTYPE_MOSTLY_Q4_0; }
+    if (name == "q4_1") { return GGML_FTYPE_MOSTLY_Q4_1; }
+    if (name == "q5_0") { return GGML_FTYPE_MOSTLY_Q5_0; }
+    if (name == "q5_1") { return GGML_FTYPE_MOSTLY_Q5_1; }
+    if (name == "q8_0") { return GGML_FTYPE_MOSTLY_Q8_0; }
+    return GGML_FTYPE_UNKNOWN;
+}
+
+// weight type stored in the model header, -1 if it can't be read
+static int32_t whisper_model_file_ftype(const std::string & fname) {
+    std::ifstream finp(fname, std::ios::binary);
+
+    uint32_t magic = 0;
+    int32_t  hparams[11] = {}; // n_vocab .. n_mels, ftype
+    finp.read((char *) &magic, sizeof(magic));
+    finp.read((char *) hparams, sizeof(hparams));
+    if (!finp || magic != GGML_FILE_MAGIC) {
+        return -1;
+    }
+
+    return hparams[10] % GGML_QNT_VERSION_FACTOR;
+}
+
+static bool whisper_model_quantize(const std::string & fname_inp, const std::string & fname_out, ggml_ftype ftype) {
+    LOG_INF("%s: quantizing '%s' to '%s'\n", __func__, fname_inp.c_str(), fname_out.c_str());
+
+    std::ifstream finp(fname_inp, std::ios::binary);
+    if (!finp) {
+        LOG_ERR("%s: failed to open '%s' for reading\n", __func__, fname_inp.c_str());
+        return false;
+    }
+
+    std::ofstream fout(fname_out, std::ios::binary);
+    if (!fout) {
+        LOG_ERR("%s: failed to open '%s' for writing\n", __func__, fname_out.c_str());
+        return false;
+    }
+
+    // verify magic
+    {
+        uint32_t magic;
+        finp.read((char *) &magic, sizeof(magic));
+        if (magic != GGML_FILE_MAGIC) {
+            LOG_ERR("%s: invalid model file '%s' (bad magic)\n", __func__, fname_inp.c_str());
+            return false;
+        }
+        fout.write((char *) &magic, sizeof(magic));
+    }
+
+    // hparams: n_vocab, n_audio_ctx, n_audio_state, n_audio_head, n_audio_layer,
+    //          n_text_ctx, n_text_state, n_text_head, n_text_layer, n_mels, ftype
+    {
+        int32_t hparams[11];
+        finp.read((char *) hparams, sizeof(hparams));
+
+        hparams[10] = GGML_QNT_VERSION*GGML_QNT_VERSION_FACTOR + ftype;
+        fout.write((char *) hparams, sizeof(hparams));
+    }
+
+    // mel filters
+    {
+        int32_t n_mel = 0;
+        int32_t n_fft = 0;
+        finp.read ((char *) &n_mel, sizeof(n_mel));
+        fout.write((char *) &n_mel, sizeof(n_mel));
+        finp.read ((char *) &n_fft, sizeof(n_fft));
+        fout.write((char *) &n_fft, sizeof(n_fft));
+
+        std::vector<float> data((size_t) n_mel*n_fft);
+        finp.read ((char *) data.data(), data.size()*sizeof(float));
+        fout.write((char *) data.data(), data.size()*sizeof(float));
+    }
+
+    // vocab
+    {
+        int32_t n_vocab = 0;
+        finp.read ((char *) &n_vocab, sizeof(n_vocab));
+        fout.write((char *) &n_vocab, sizeof(n_vocab));
+
+        std::string word;
+        for (int i = 0; i < n_vocab; i++) {
+            uint32_t len = 0;
+            finp.read ((char *) &len, sizeof(len));
+            fout.write((char *) &len, sizeof(len));
+
+            word.resize(len);
+            finp.read ((char *) word.data(), len);
+            fout.write((char *) word.data(), len);
+        }
+    }
+
+    if (!finp) {
+        LOG_ERR("%s: truncated model file '%s'\n", __func__, fname_inp.c_str());
+        return false;
+    }
+
+    // regexes of tensor names to not be quantized
+    const std::vector<std::string> to_skip = {
+        "encoder.conv1.bias",
+        "encoder.conv2.bias",
+        "encoder.positional_embedding",
+        "decoder.positional_embedding",
+    };
+
+    if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, to_skip)) {
+        LOG_ERR("%s: failed to quantize model '%s'\n", __func__, fname_inp.c_str());
+        return false;
+    }
+
+    return (bool) fout.flush();
+}
+
+static std::string whisper_quantized_path(const std::string & fname, const std::string & type) {
+    const std::string ext = ".bin";
+    if (fname.size() > ext.size() && fname.compare(fname.size() - ext.size(), ext.size(), ext) == 0) {
+        return fname.substr(0, fname.size() - ext.size()) + "-" + type + ext;
+    }
+    return fname + "-" + type;
+}
+
+static bool file_newer_than(const std::string & path, const std::string & other) {
+#if defined(_WIN32)
+    return std::ifstream(path).good();
+#else
+    struct stat st_path;
+    struct stat st_other;
+    return stat(path.c_str(), &st_path) == 0 && stat(other.c_str(), &st_other) == 0 && st_path.st_mtime >= st_other.st_mtime;
+#endif
+}
+
+// returns the file to load: the original model, a saved quantized copy or a
+// temporary file (is_temp) the caller removes after loading
+static std::string whisper_model_prepare(const whisper_params & params, bool & is_temp, int64_t & t_quantize_us) {
+    is_temp       = false;
+    t_quantize_us = 0;
+
+    if (params.quantize.empty()) {
+        return params.model;
+    }
+
+    const int32_t ftype_src = whisper_model_file_ftype(params.model);
+    if (ftype_src != GGML_FTYPE_ALL_F32 && ftype_src != GGML_FTYPE_MOSTLY_F16) {
+        LOG_INF("%s: '%s' is not an f16/f32 model, loading it as is\n", __func__, params.model.c_str());
+        return params.model;
+    }
+
+    const std::string fname_out = whisper_quantized_path(params.model, params.quantize);
+    if (params.quantize_save && file_newer_than(fname_out, params.model)) {
+        return fname_out;
+    }
+
+    trace_span span("quantize");
+
+    const int64_t t_start_us = time_us();
+
+    // write to a temporary name first so a crash never leaves a truncated model behind
+    const std::string fname_tmp = fname_out + ".tmp" + std::to_string(time_us());
+    bool ok = whisper_model_quantize(params.model, fname_tmp, whisper_quantize_ftype(params.quantize));
+
+    t_quantize_us = time_us() - t_start_us;
+
+    if (!ok) {
+        std::remove(fname_tmp.c_str());
+        LOG_WRN("%s: quantization failed, loading '%s' as is\n", __func__, params.model.c_str());
+        return params.model;
+    }
+
+    if (!params.quantize_save) {
+        is_temp = true;
+        return fname_tmp;
+    }
+
+    if (std::rename(fname_tmp.c_str(), fname_out.c_str()) != 0) {
+        LOG_WRN("%s: failed to save '%s', using a temporary copy\n", __func__, fname_out.c_str());
+        is_temp = true;
+        return fname_tmp;
+    }
+
+    return fname_out;
+}
+
+// a job pinned to a NUMA node gets a copy of the model loaded on that node, as
+// long as the memory budget and the node's free memory leave room for one.
+// otherwise, and for jobs that aren't pinned, it shares whatever copy is resident
+// must be called with g_models.mutex held
+static std::string whisper_model_key_locked(const whisper_params & params, int & numa_node) {
+    const std::string key = whisper_model_key(params);
+
+    const std::string node_key = key + "|node" + std::to_string(params.numa_node);
+
+    const whisper_model_entry * copy = nullptr;
+    int64_t resident = 0;
+    for (const auto & it : g_models.entries) {
+        if (params.numa_node >= 0 && it.first == node_key) {
+            numa_node = params.numa_node;
+            return node_key;
+        }
+        if (copy == nullptr && (it.first == key || it.first.compare(0, key.size() + 5, key + "|node") == 0)) {
+            copy = it.second.get();
+        }
+        resident += it.second->size_bytes;
+    }
+
+    // an unpinned job takes any copy
+    if (params.numa_node < 0) {
+        numa_node = copy != nullptr ? copy->numa_node : -1;
+        return copy != nullptr ? copy->key : key;
+    }
+
+    if (copy != nullptr) {
+        const int64_t n_copy = std::max(copy->size_bytes, file_size_bytes(params.model));
+        const int64_t n_free = numa_node_free_bytes(params.numa_node);
+        if ((g_models.budget_bytes > 0 && resident + n_copy > g_models.budget_bytes) || (n_free >= 0 && n_free < n_copy)) {
+            numa_node = copy->numa_node;
+            return copy->key;
+        }
+    }
+
+    numa_node = params.numa_node;
+    return node_key;
+}
+
+static bool whisper_model_acquire(const whisper_params & params, whisper_model_lease & lease) {
+    {
+        std::lock_guard<std::mutex> lock(g_models.mutex);
+        int numa_node = -1;
+        const std::string key = whisper_model_key_locked(params, numa_node);
+        auto & entry = g_models.entries[key];
+        if (entry == nullptr) {
+            entry = std::make_shared<whisper_model_entry>();
+            entry->key       = key;
+            entry->path      = params.model;
+            entry->use_gpu   = params.use_gpu;
+            entry->numa_node = numa_node;
+        }
+        entry->n_active++;
+        entry->t_last_used_us = time_us();
+        lease.entry = entry;
+    }
+
+    int64_t t_wait_start_us = time_us();
+    std::unique_lock<std::mutex> lock(lease.entry->mutex);
+    lease.t_wait_us = time_us() - t_wait_start_us;
+
+    whisper_model_entry & entry = *lease.entry;
+
+    if (entry.ctx == nullptr) {
+        // make room up front using the file size as a lower bound for the weights
+        {
+            std::lock_guard<std::mutex> lock(g_models.mutex);
+            whisper_model_evict_locked(file_size_bytes(params.model), &entry);
+        }
+
+        bool is_temp = false;
+        const std::string fname_model = whisper_model_prepare(params, is_temp, lease.t_quantize_us);
+
+        struct whisper_context_params cparams = whisper_context_default_params();
+        cparams.use_gpu = params.use_gpu;
+
+        std::unique_lock<std::mutex> load_lock(g_models.load_mutex);
+
+        entry.huge_pages = params.huge_pages && huge_pages_available();
+        if (params.huge_pages && !entry.huge_pages) {
+            LOG_WRN("%s: transparent huge pages are not available, using normal pages\n", __func__);
+        }
+        const std::vector<huge_page_region> regions_before = entry.huge_pages ? huge_pages_regions() : std::vector<huge_page_region>();
+
+        const int64_t rss_before = current_rss_bytes();
+
+        const int64_t t_load_start_us = time_us();
+        entry.ctx = whisper_init_from_file_with_params(fname_model.c_str(), cparams);
+        lease.t_load_us = time_us() - t_load_start_us;
+        trace_record("model_load", t_load_start_us, t_load_start_us + lease.t_load_us);
+
+        if (is_temp) {
+            std::remove(fname_model.c_str());
+        }
+
+        if (entry.ctx == nullptr) {
+            load_lock.unlock();
+            lock.unlock();
+            {
+                std::lock_guard<std::mutex> lock(g_models.mutex);
+                auto it = g_models.entries.find(entry.key);
+                if (it != g_models.entries.end() && it->second == lease.entry && entry.n_active == 1) {
+                    g_models.entries.erase(it);
+                }
+            }
+            lease.release();
+            return false;
+        }
+
+        // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
+        whisper_ctx_init_openvino_encoder(entry.ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+
+        const int64_t rss_delta = current_rss_bytes() - rss_before;
+        const int64_t n_huge    = entry.huge_pages ? huge_pages_advise_new(regions_before, true) : 0;
+        load_lock.unlock();
+
+        entry.load_ms = lease.t_load_us/1000.0f;
+        lease.loaded  = true;
+
+        {
+            std::lock_guard<std::mutex> lock(g_models.mutex);
+            entry.size_bytes       = std::max<int64_t>({ rss_delta, file_size_bytes(fname_model), 1 });
+            entry.huge_pages_bytes = n_huge;
+            whisper_model_evict_locked(0, &entry);
+        }
+    }
+
+    t_wait_start_us = time_us();
+    entry.state_cv.wait(lock, [&]() {
+        return !entry.ctx_state_busy || !entry.free_states.empty() || 1 + (int) entry.states.size() < params.parallel;
+    });
+    lease.t_wait_us += time_us() - t_wait_start_us;
+
+    if (!entry.ctx_state_busy) {
+        entry.ctx_state_busy = true;
+
+        // the context is reused across jobs, keep whisper's counters per job
+        whisper_reset_timings(entry.ctx);
+    } else if (!entry.free_states.empty()) {
+        lease.state = entry.free_states.back();
+        entry.free_states.pop_back();
+    } else {
+        std::unique_lock<std::mutex> load_lock(g_models.load_mutex);
+
+        const std::vector<huge_page_region> regions_before = entry.huge_pages ? huge_pages_regions() : std::vector<huge_page_region>();
+
+        const int64_t rss_before = current_rss_bytes();
+
+        const int64_t t_init_start_us = time_us();
+        lease.state = whisper_init_state(entry.ctx);
+        trace_record("state_init", t_init_start_us, time_us());
+
+        const int64_t rss_delta = current_rss_bytes() - rss_before;
+        const int64_t n_huge    = entry.huge_pages && lease.state != nullptr ? huge_pages_advise_new(regions_before, false) : 0;
+        load_lock.unlock();
+
+        if (lease.state == nullptr) {
+            lock.unlock();
+            lease.release();
+            return false;
+        }
+
+        entry.states.push_back(lease.state);
+
+        LOG_INF("%s: '%s' now has %d states\n", __func__, entry.path.c_str(), 1 + (int) entry.states.size());
+
+        std::lock_guard<std::mutex> guard(g_models.mutex);
+        entry.size_bytes       += std::max<int64_t>(rss_delta, 0);
+        entry.huge_pages_bytes += n_huge;
+        whisper_model_evict_locked(0, &entry);
+    }
+
+    lease.ctx = entry.ctx;
+    return true;
+}
+
+// result accessors for the state a lease holds
+
+static int whisper_lease_n_segments(const whisper_model_lease & lease) {
+    return lease.state ? whisper_full_n_segments_from_state(lease.state) : whisper_full_n_segments(lease.ctx);
+}
+
+static int whisper_lease_n_tokens(const whisper_model_lease & lease, int i_segment) {
+    return lease.state ? whisper_full_n_tokens_from_state(lease.state, i_segment) : whisper_full_n_tokens(lease.ctx, i_segment);
+}
+
+static int64_t whisper_lease_segment_t0(const whisper_model_lease & lease, int i_segment) {
+    return lease.state ? whisper_full_get_segment_t0_from_state(lease.state, i_segment) : whisper_full_get_segment_t0(lease.ctx, i_segment);
+}
+
+static int64_t whisper_lease_segment_t1(const whisper_model_lease & lease, int i_segment) {
+    return lease.state ? whisper_full_get_segment_t1_from_state(lease.state, i_segment) : whisper_full_get_segment_t1(lease.ctx, i_segment);
+}
+
+static const char * whisper_lease_segment_text(const whisper_model_lease & lease, int i_segment) {
+    return lease.state ? whisper_full_get_segment_text_from_state(lease.state, i_segment) : whisper_full_get_segment_text(lease.ctx, i_segment);
+}
+
+static int whisper_lease_lang_id(const whisper_model_lease & lease) {
+    return lease.state ? whisper_full_lang_id_from_state(lease.state) : whisper_full_lang_id(lease.ctx);
+}
+
+static const char * whisper_lease_token_text(const whisper_model_lease & lease, int i_segment, int i_token) {
+    return lease.state ? whisper_full_get_token_text_from_state(lease.ctx, lease.state, i_segment, i_token) : whisper_full_get_token_text(lease.ctx, i_segment, i_token);
+}
+
+static whisper_token_data whisper_lease_token_data(const whisper_model_lease & lease, int i_segment, int i_token) {
+    return lease.state ? whisper_full_get_token_data_from_state(lease.state, i_segment, i_token) : whisper_full_get_token_data(lease.ctx, i_segment, i_token);
+}
+
+// short synthetic encode + decode so the first real job doesn't pay for graph
+// allocation and cold caches
+static json whisper_model_warmup(const whisper_model_lease & lease, int n_threads) {
+    trace_span span("warmup");
+
+    struct whisper_context * ctx   = lease.ctx;
+    struct whisper_state   * state = lease.state;
+
+    json metrics;
+
+    const std::vector<float> pcmf32(WHISPER_SAMPLE_RATE, 0.0f); // 1 s of silence
+
+    int64_t t_start_us = time_us();
+    if ((state ? whisper_pcm_to_mel_with_state(ctx, state, pcmf32.data(), pcmf32.size(), n_threads)
+               : whisper_pcm_to_mel(ctx, pcmf32.data(), pcmf32.size(), n_threads)) != 0) {
+        return nullptr;
+    }
+    metrics["mel_ms"] = (time_us() - t_start_us)/1000.0f;
+
+    t_start_us = time_us();
+    if ((state ? whisper_encode_with_state(ctx, state, 0, n_threads) : whisper_encode(ctx, 0, n_threads)) != 0) {
+        return nullptr;
+    }
+    metrics["encode_ms"] = (time_us() - t_start_us)/1000.0f;
+
+    std::vector<whisper_token> tokens = { whisper_token_sot(ctx) };
+    if (whisper_is_multilingual(ctx)) {
+        tokens.push_back(whisper_token_lang(ctx, whisper_lang_id("en")));
+        tokens.push_back(whisper_token_transcribe(ctx));
+    }
+
+    t_start_us = time_us();
+    if ((state ? whisper_decode_with_state(ctx, state, tokens.data(), tokens.size(), 0, n_threads)
+               : whisper_decode(ctx, tokens.data(), tokens.size(), 0, n_threads)) != 0) {
+        return nullptr;
+    }
+    metrics["decode_ms"] = (time_us() - t_start_us)/1000.0f;
+
+    return metrics;
+}
+
+// whether the lease's model got huge pages and, if so, how much of the process
+// they back - the kernel may have fallen back to normal pages for some of it
+static void whisper_huge_pages_metrics(const whisper_model_lease & lease, json & metrics) {
+    int64_t n_advised = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_models.mutex);
+        n_advised = lease.entry->huge_pages_bytes;
+    }
+
+    metrics["huge_pages"] = lease.entry->huge_pages;
+    if (lease.entry->huge_pages) {
+        metrics["huge_pages_advised_bytes"] = n_advised;
+        metrics["huge_pages_backed_bytes"]  = huge_pages_backed_bytes();
+    }
+}
+
+json whisper_model_cache_to_json() {
+    std::lock_guard<std::mutex> lock(g_models.mutex);
+
+    const int64_t t_now_us = time_us();
+
+    int64_t resident = 0;
+
+    json models = json::array();
+    for (const auto & it : g_models.entries) {
+        const whisper_model_entry & entry = *it.second;
+        if (entry.size_bytes == 0) {
+            continue;
+        }
+        resident += entry.size_bytes;
+
+        json model;
+        model["model"]      = entry.path;
+        model["use_gpu"]    = entry.use_gpu;
+        if (entry.numa_node >= 0) {
+            model["numa_node"] = entry.numa_node;
+        }
+        model["size_bytes"] = entry.size_bytes;
+        model["active"]     = entry.n_active;
+        model["idle_ms"]    = entry.n_active > 0 ? 0.0f : (t_now_us - entry.t_last_used_us)/1000.0f;
+        model["load_ms"]    = entry.load_ms;
+        if (entry.huge_pages) {
+            model["huge_pages_bytes"] = entry.huge_pages_bytes;
+        }
+        models.push_back(model);
+    }
+
+    json result;
+    result["budget_bytes"]   = g_models.budget_bytes;
+    result["resident_bytes"] = resident;
+    result["models"]         = models;
+    return result;
+}
+
+json load_model(const whisper_request & request) {
+    json jsonResult;
+    jsonResult["@type"] = "loadModel";
+
+    const whisper_params & params = request.params;
+
+    log_level_scope log_scope(params.log_level);
+
+    if (!params.quantize.empty() && whisper_quantize_ftype(params.quantize) == GGML_FTYPE_UNKNOWN) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "unknown quantization type";
+        return jsonResult;
+    }
+
+    cpu_affinity_scope affinity;
+    std::string affinity_error;
+    if (!affinity.init(params, affinity_error)) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = affinity_error;
+        return jsonResult;
+    }
+
+    whisper_lib_init();
+
+    whisper_model_lease lease;
+    if (!whisper_model_acquire(params, lease)) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "failed to initialize whisper context";
+        return jsonResult;
+    }
+
+    jsonResult["model"]  = params.model;
+    jsonResult["cached"] = !lease.loaded;
+
+    json metrics;
+    metrics["load_ms"]     = lease.entry->load_ms;
+    metrics["wait_ms"]     = lease.t_wait_us/1000.0f;
+    metrics["quantize_ms"] = lease.t_quantize_us/1000.0f;
+    whisper_huge_pages_metrics(lease, metrics);
+
+    if (request.warmup) {
+        json warmup = whisper_model_warmup(lease, params.n_threads);
+        if (warmup.is_null()) {
+            jsonResult["@type"] = "error";
+            jsonResult["message"] = "model warm-up failed";
+            return jsonResult;
+        }
+        metrics["warmup"] = warmup;
+    }
+
+    jsonResult["metrics"] = metrics;
+    return jsonResult;
+}
+
+#define AUTOTUNE_DECODE_STEPS 32
+#define AUTOTUNE_MAX_PROCESSORS 4
+
+struct whisper_autotune_sample {
+    int64_t t_mel_us    = 0;
+    int64_t t_encode_us = 0;
+    int64_t t_decode_us = 0;
+    bool    ok          = false;
+};
+
+// 30 s - one full encoder window - of a gliding harmonic tone, amplitude
+// modulated at a syllable rate, over low noise. only the cost of processing it
+// matters, and that does not depend on what it sounds like
+static std::vector<float> whisper_autotune_input() {
+    std::vector<float> pcmf32(30*WHISPER_SAMPLE_RATE);
+
+    const double two_pi = 6.283185307179586;
+
+    uint32_t seed  = 1;
+    double   phase = 0.0;
+    for (size_t i = 0; i < pcmf32.size(); ++i) {
+        const double t  = (double) i/WHISPER_SAMPLE_RATE;
+        const double f0 = 140.0 + 40.0*sin(two_pi*0.5*t);
+        phase += two_pi*f0/WHISPER_SAMPLE_RATE;
+
+        const double voice    = 0.5*sin(phase) + 0.25*sin(2.0*phase) + 0.125*sin(3.0*phase);
+        const double envelope = 0.5*(1.0 + sin(two_pi*4.0*t));
+
+        seed = seed*1664525u + 1013904223u;
+        const double noise = ((seed >> 8)/16777216.0 - 0.5)*0.02;
+
+        pcmf32[i] = (float) (0.3*voice*envelope + noise);
+    }
+
+    return pcmf32;
+}
+
+// one window on one state: mel, encode, the prompt and AUTOTUNE_DECODE_STEPS
+// single-token decodes, as greedy sampling does them
+static whisper_autotune_sample whisper_autotune_window(struct whisper_context * ctx, struct whisper_state * state, const std::vector<float> & pcmf32, int n_threads) {
+    whisper_autotune_sample sample;
+
+    int64_t t_start_us = time_us();
+    if (whisper_pcm_to_mel_with_state(ctx, state, pcmf32.data(), pcmf32.size(), n_threads) != 0) {
+        return sample;
+    }
+    sample.t_mel_us = time_us() - t_start_us;
+
+    t_start_us = time_us();
+    if (whisper_encode_with_state(ctx, state, 0, n_threads) != 0) {
+        return sample;
+    }
+    sample.t_encode_us = time_us() - t_start_us;
+
+    std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
+    if (whisper_is_multilingual(ctx)) {
+        prompt.push_back(whisper_token_lang(ctx, whisper_lang_id("en")));
+        prompt.push_back(whisper_token_transcribe(ctx));
+    }
+
+    t_start_us = time_us();
+    if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
+        return sample;
+    }
+    const whisper_token token = whisper_token_beg(ctx);
+    for (int i = 0; i < AUTOTUNE_DECODE_STEPS; ++i) {
+        if (whisper_decode_with_state(ctx, state, &token, 1, prompt.size() + i, n_threads) != 0) {
+            return sample;
+        }
+    }
+    sample.t_decode_us = time_us() - t_start_us;
+
+    sample.ok = true;
+    return sample;
+}
+
+// the thread counts tried: powers of two up to the physical cores, the physical
+// cores, and all logical cores when SMT is on. processors split the cores
+// between windows run side by side, as whisper_full_parallel() does. the
+// benchmark shares the machine with any running jobs, so run it on an idle host
+json autotune(const whisper_request & request) {
+    trace_span span("autotune");
+
+    const int64_t t_start_us = time_us();
+
+    json jsonResult;
+    jsonResult["@type"] = "autotune";
+
+    const whisper_params & params = request.params;
+
+    log_level_scope log_scope(params.log_level);
+
+    if (!params.quantize.empty() && whisper_quantize_ftype(params.quantize) == GGML_FTYPE_UNKNOWN) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "unknown quantization type";
+        return jsonResult;
+    }
+
+    cpu_affinity_scope affinity;
+    std::string affinity_error;
+    if (!affinity.init(params, affinity_error)) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = affinity_error;
+        return jsonResult;
+    }
+
+    whisper_lib_init();
+
+    whisper_model_lease lease;
+    if (!whisper_model_acquire(params, lease)) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "failed to initialize whisper context";
+        return jsonResult;
+    }
+
+    const cpu_topology topology = cpu_topology_get();
+
+    std::vector<int> thread_counts;
+    for (int n = 1; n < topology.n_physical; n *= 2) {
+        thread_counts.push_back(n);
+    }
+    thread_counts.push_back(topology.n_physical);
+    if (topology.n_logical > topology.n_physical) {
+        thread_counts.push_back(topology.n_logical);
+    }
+
+    std::vector<std::pair<int, int>> candidates; // (threads, processors)
+    int n_states = 1;
+    for (int n_threads : thread_counts) {
+        for (int n_processors = 1; n_processors <= AUTOTUNE_MAX_PROCESSORS && n_threads*n_processors <= topology.n_logical; n_processors *= 2) {
+            candidates.emplace_back(n_threads, n_processors);
+            n_states = std::max(n_states, n_processors);
+        }
+    }
+
+    // states of their own, so the benchmark never waits on the pool
+    std::vector<struct whisper_state *> states;
+    for (int i = 0; i < n_states; ++i) {
+        struct whisper_state * state = whisper_init_state(lease.ctx);
+        if (state == nullptr) {
+            break;
+        }
+        states.push_back(state);
+    }
+
+    const std::vector<float> pcmf32 = whisper_autotune_input();
+
+    json results = json::array();
+    int   best_threads    = 0;
+    int   best_processors = 0;
+    float best_score      = 0.0f;
+    float best_window_ms  = 0.0f;
+
+    // the first window on a state pays for one-time allocations
+    bool ok = states.size() == (size_t) n_states;
+    for (size_t i = 0; ok && i < states.size(); ++i) {
+        ok = whisper_autotune_window(lease.ctx, states[i], pcmf32, topology.n_physical).ok;
+    }
+
+    for (size_t c = 0; ok && c < candidates.size(); ++c) {
+        const int n_threads    = candidates[c].first;
+        const int n_processors = candidates[c].second;
+
+        std::vector<whisper_autotune_sample> samples(n_processors);
+
+        const int64_t t_run_us = time_us();
+        std::vector<std::thread> workers;
+        for (int i = 1; i < n_processors; ++i) {
+            workers.emplace_back([&, i]() {
+                samples[i] = whisper_autotune_window(lease.ctx, states[i], pcmf32, n_threads);
+            });
+        }
+        samples[0] = whisper_autotune_window(lease.ctx, states[0], pcmf32, n_threads);
+        for (auto & worker : workers) {
+            worker.join();
+        }
+        const int64_t t_wall_us = time_us() - t_run_us;
+
+        for (const auto & sample : samples) {
+            ok = ok && sample.ok;
+        }
+        if (!ok) {
+            break;
+        }
+
+        // processors split the audio into chunks decoded without each other's
+        // context, so each extra one has to buy 10% to be chosen
+        const float window_ms = t_wall_us/1000.0f/n_processors;
+        const float score     = window_ms*(1.0f + 0.1f*(n_processors - 1));
+
+        if (best_threads == 0 || score < best_score) {
+            best_threads    = n_threads;
+            best_processors = n_processors;
+            best_score      = score;
+            best_window_ms  = window_ms;
+        }
+
+        json result;
+        result["threads"]    = n_threads;
+        result["processors"] = n_processors;
+        result["mel_ms"]     = samples[0].t_mel_us/1000.0f;
+        result["encode_ms"]  = samples[0].t_encode_us/1000.0f;
+        result["decode_ms"]  = samples[0].t_decode_us/1000.0f;
+        result["window_ms"]  = window_ms;
+        results.push_back(result);
+
+        LOG_INF("%s: %2d threads x %d processors: %8.2f ms per window\n", __func__, n_threads, n_processors, window_ms);
+    }
+
+    for (struct whisper_state * state : states) {
+        whisper_free_state(state);
+    }
+
+    if (!ok) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "autotune benchmark failed";
+        return jsonResult;
+    }
+
+    json config;
+    config["threads"]    = best_threads;
+    config["processors"] = best_processors;
+    config["window_ms"]  = best_window_ms;
+    config["n_logical"]  = topology.n_logical;
+    config["n_physical"] = topology.n_physical;
+    config["model"]      = params.model;
+    config["results"]    = results;
+
+    const bool saved = whisper_autotune_save(config);
+
+    jsonResult["threads"]    = best_threads;
+    jsonResult["processors"] = best_processors;
+    jsonResult["window_ms"]  = best_window_ms;
+    jsonResult["n_logical"]  = topology.n_logical;
+    jsonResult["n_physical"] = topology.n_physical;
+    jsonResult["saved"]      = saved;
+    jsonResult["results"]    = results;
+    jsonResult["metrics"]["wall_ms"] = (time_us() - t_start_us)/1000.0f;
+    return jsonResult;
+}
+
+// per-token results are returned as parallel arrays per segment instead of an
+// object per token, which keeps large responses cheap to build and to parse
+
+static json json_array_reserved(size_t n) {
+    json array = json::array();
+    array.get_ref<json::array_t &>().reserve(n);
+    return array;
+}
+
+// the code point text starts with, -1 when it starts inside one: whisper's byte-level
+// tokens can split a multi-byte character. a character cut short by the end of the
+// token is decoded as far as the token has it
+static int32_t utf8_lead_code_point(const char * text) {
+    const uint8_t c = (uint8_t) text[0];
+
+    int     n  = 0;
+    int32_t cp = 0;
+    if (c < 0x80) {
+        return c;
+    } else if ((c & 0xe0) == 0xc0) {
+        n  = 1;
+        cp = c & 0x1f;
+    } else if ((c & 0xf0) == 0xe0) {
+        n  = 2;
+        cp = c & 0x0f;
+    } else if ((c & 0xf8) == 0xf0) {
+        n  = 3;
+        cp = c & 0x07;
+    } else {
+        return -1;
+    }
+
+    bool more = true;
+    for (int i = 1; i <= n; ++i) {
+        uint8_t b = more ? (uint8_t) text[i] : 0x80;
+        if ((b & 0xc0) != 0x80) {
+            more = false;
+            b    = 0x80;
+        }
+        cp = (cp << 6) | (b & 0x3f);
+    }
+    return cp;
+}
+
+// scripts written without spaces between words: CJK ideographs, kana and CJK
+// punctuation. hangul is left out, korean puts spaces between words
+static bool utf8_is_cjk(int32_t cp) {
+    return (cp >= 0x3000  && cp <= 0x30ff)  || // punctuation, hiragana, katakana
+           (cp >= 0x3400  && cp <= 0x4dbf)  ||
+           (cp >= 0x4e00  && cp <= 0x9fff)  ||
+           (cp >= 0xf900  && cp <= 0xfaff)  ||
+           (cp >= 0xff00  && cp <= 0xffef)  || // fullwidth forms
+           (cp >= 0x20000 && cp <= 0x2ffff);
+}
+
+// words of a segment. a token without a leading space continues the previous
+// word and special tokens (timestamps, speaker turns) are skipped. chinese and
+// japanese have no spaces, so there every CJK character is a word of its own.
+// start/end are in 10 ms units like the segment times, p is the mean token
+// probability. the words keep their leading space so joining them gives the
+// segment text
+static json whisper_segment_words(const whisper_model_lease & lease, int i_segment, int64_t t_offset) {
+    const whisper_token token_eot = whisper_token_eot(lease.ctx);
+    const int n_tokens = whisper_lease_n_tokens(lease, i_segment);
+
+    json text  = json_array_reserved(n_tokens);
+    json start = json_array_reserved(n_tokens);
+    json end   = json_array_reserved(n_tokens);
+    json p     = json_array_reserved(n_tokens);
+
+    std::string word;
+    int64_t t0 = 0;
+    int64_t t1 = 0;
+    float p_sum = 0.0f;
+    int   n     = 0;
+    bool  cjk   = false; // the last character started was CJK
+
+    auto flush = [&]() {
+        if (n == 0) {
+            return;
+        }
+        text.push_back(word);
+        start.push_back(t0);
+        end.push_back(t1);
+        p.push_back(p_sum/n);
+        word.clear();
+        p_sum = 0.0f;
+        n     = 0;
+    };
+
+    for (int j = 0; j < n_tokens; ++j) {
+        const whisper_token_data data = whisper_lease_token_data(lease, i_segment, j);
+        if (data.id >= token_eot) {
+            continue;
+        }
+
+        const char * token = whisper_lease_token_text(lease, i_segment, j);
+
+        // a token that carries on a split character stays in its word
+        const int32_t cp = utf8_lead_code_point(token);
+        if (token[0] == ' ' || (cp >= 0 && (cjk || utf8_is_cjk(cp)))) {
+            flush();
+        }
+        if (cp >= 0) {
+            cjk = utf8_is_cjk(cp);
+        }
+        if (n == 0) {
+            t0 = t_offset + data.t0;
+        }
+        t1 = t_offset + data.t1;
+        word  += token;
+        p_sum += data.p;
+        n++;
+    }
+    flush();
+
+    json words;
+    words["text"]  = std::move(text);
+    words["start"] = std::move(start);
+    words["end"]   = std::move(end);
+    words["p"]     = std::move(p);
+    return words;
+}
+
+// every token of a segment, special tokens included
+static json whisper_segment_tokens(const whisper_model_lease & lease, int i_segment, int64_t t_offset) {
+    const int n_tokens = whisper_lease_n_tokens(lease, i_segment);
+
+    json id    = json_array_reserved(n_tokens);
+    json start = json_array_reserved(n_tokens);
+    json end   = json_array_reserved(n_tokens);
+    json p     = json_array_reserved(n_tokens);
+    json plog  = json_array_reserved(n_tokens);
+
+    for (int j = 0; j < n_tokens; ++j) {
+        const whisper_token_data data = whisper_lease_token_data(lease, i_segment, j);
+        id.push_back(data.id);
+        start.push_back(t_offset + data.t0);
+        end.push_back(t_offset + data.t1);
+        p.push_back(data.p);
+        plog.push_back(data.plog);
+    }
+
+    json tokens;
+    tokens["id"]    = std::move(id);
+    tokens["start"] = std::move(start);
+    tokens["end"]   = std::move(end);
+    tokens["p"]     = std::move(p);
+    tokens["plog"]  = std::move(plog);
+    return tokens;
+}
+
+//
+// job arena
+//
+// a job's sample buffers - the decoded audio, mono and stereo, and the window a
+// 16-bit format is converted into - are bump-allocated from an arena that
+// belongs to the worker thread, and dropped together when the job ends, instead
+// of going through the general heap that all workers contend on. between jobs
+// the arena keeps one block, grown to what the previous jobs needed (up to
+// JOB_ARENA_MAX_RETAINED), so a worker running jobs of similar length stops
+// touching the heap for its audio after its first job. everything else - the
+// json response, segment text and speakers, checkpoint tokens - is on the heap
+//
+
+#define JOB_ARENA_MAX_RETAINED (64ull << 20)
+
+// the heap behind the arena's block, counting what had to come from it
+struct job_arena_upstream : std::pmr::memory_resource {
+    size_t n_bytes = 0;
+
+    void * do_allocate(size_t bytes, size_t alignment) override {
+        n_bytes += bytes;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void * p, size_t bytes, size_t alignment) override {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override {
+        return this == &other;
+    }
+};
+
+struct job_arena {
+    std::unique_ptr<std::byte[]> block;
+    size_t                       block_size = 0;
+
+    job_arena_upstream upstream;
+    std::optional<std::pmr::monotonic_buffer_resource> resource;
+
+    int depth = 0; // nested scopes share the outermost one's arena
+};
+
+static thread_local job_arena g_job_arena;
+
+// everything allocated from resource() must be gone when the outermost scope ends
+struct job_arena_scope {
+    job_arena_scope() {
+        job_arena & arena = g_job_arena;
+        if (arena.depth++ > 0) {
+            return;
+        }
+        arena.upstream.n_bytes = 0;
+        if (arena.block_size > 0) {
+            arena.resource.emplace(arena.block.get(), arena.block_size, &arena.upstream);
+        } else {
+            arena.resource.emplace(&arena.upstream);
+        }
+    }
+
+    job_arena_scope(const job_arena_scope &) = delete;
+
+    ~job_arena_scope() {
+        job_arena & arena = g_job_arena;
+        if (--arena.depth > 0) {
+            return;
+        }
+        arena.resource.reset(); // hands the overflow chunks back to the heap
+
+        if (arena.upstream.n_bytes > 0 && arena.block_size < JOB_ARENA_MAX_RETAINED) {
+            arena.block_size = std::min<size_t>(arena.block_size + arena.upstream.n_bytes, JOB_ARENA_MAX_RETAINED);
+            arena.block.reset(new std::byte[arena.block_size]);
+        }
+    }
+
+    std::pmr::memory_resource * resource() const {
+        return &*g_job_arena.resource;
+    }
+};
+
+// 16 kHz samples of a job, read from its WAV file or passed in memory, laid out like
+// read_wav() returns them
+struct whisper_pcm_input {
+    whisper_pcm_samples                   mono;
+    std::pmr::vector<whisper_pcm_samples> stereo; // empty, or both channels
+
+    whisper_pcm_input(std::pmr::memory_resource * resource, int format) : mono(resource), stereo(resource) {
+        mono.format = format;
+    }
+
+    void resize_stereo(size_t n) {
+        stereo.resize(2);
+        for (auto & channel : stereo) {
+            channel.format = mono.format;
+            channel.resize(n);
+        }
+    }
+
+    size_t bytes() const {
+        size_t n = mono.bytes();
+        for (const auto & channel : stereo) {
+            n += channel.bytes();
+        }
+        return n;
+    }
+};
+
+// read_wav() from whisper.cpp's examples, reading into the job arena: the samples
+// are converted in chunks instead of through a full-length int16 copy
+static bool whisper_read_wav(const std::string & fname, whisper_pcm_input & pcm, bool stereo, std::string & error) {
+    drwav wav;
+    // pipe input from stdin. on the heap rather than in the job arena, where every
+    // reallocation while it grows would stay allocated until the job ends
+    std::vector<uint8_t> wav_data;
+
+    if (fname == "-") {
+        uint8_t buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+            wav_data.insert(wav_data.end(), buf, buf + n);
+        }
+        if (!drwav_init_memory(&wav, wav_data.data(), wav_data.size(), nullptr)) {
+            error = "error: failed to read WAV data from stdin";
+            return false;
+        }
+    } else if (!drwav_init_file(&wav, fname.c_str(), nullptr)) {
+        error = "error: failed to read WAV file ";
+        return false;
+    }
+
+    if (wav.channels != 1 && wav.channels != 2) {
+        error = "error: WAV file must be mono or stereo";
+    } else if (stereo && wav.channels != 2) {
+        error = "error: diarize requires a stereo WAV file";
+    } else if (wav.sampleRate != WHISPER_SAMPLE_RATE) {
+        error = "error: WAV file must be 16 kHz";
+    } else if (wav.bitsPerSample != 16) {
+        error = "error: WAV file must be 16-bit";
+    }
+    if (!error.empty()) {
+        drwav_uninit(&wav);
+        return false;
+    }
+
+    // a piped header may not know the length
+    const uint64_t n_expected = wav_data.empty() ? wav.totalPCMFrameCount : wav_data.size()/(wav.channels*wav.bitsPerSample/8);
+
+    pcm.mono.reserve(n_expected);
+    if (stereo) {
+        pcm.resize_stereo(0);
+        pcm.stereo[0].reserve(n_expected);
+        pcm.stereo[1].reserve(n_expected);
+    }
+
+    int16_t chunk[2*4096];
+    const int n_channels = wav.channels;
+    for (uint64_t n; (n = drwav_read_pcm_frames_s16(&wav, 4096, chunk)) > 0; ) {
+        for (uint64_t i = 0; i < n; ++i) {
+            if (n_channels == 1) {
+                pcm.mono.push_back(float(chunk[i])/32768.0f);
+            } else {
+                pcm.mono.push_back(float(chunk[2*i] + chunk[2*i + 1])/65536.0f);
+            }
+            if (stereo) {
+                pcm.stereo[0].push_back(float(chunk[2*i + 0])/32768.0f);
+                pcm.stereo[1].push_back(float(chunk[2*i + 1])/32768.0f);
+            }
+        }
+    }
+
+    drwav_uninit(&wav);
+    return true;
+}
+
+// stop flags of the jobs running in whisper_transcribe(), by job_id. a stop reaches
+// only the jobs running when it is requested, later jobs start with a clear flag
+struct whisper_job_registry {
+    std::mutex mutex;
+    std::map<int64_t, std::atomic<bool> *> running;
+};
+
+static whisper_job_registry g_jobs;
+
+struct whisper_job_scope {
+    const int64_t job_id;
+    std::atomic<bool> stopped{false};
+
+    explicit whisper_job_scope(int64_t id) : job_id(id) {
+        std::lock_guard<std::mutex> lock(g_jobs.mutex);
+        g_jobs.running[job_id] = &stopped;
+    }
+
+    ~whisper_job_scope() {
+        std::lock_guard<std::mutex> lock(g_jobs.mutex);
+        g_jobs.running.erase(job_id);
+    }
+};
+
+// job_id < 0 stops every running job, returns the number of jobs stopped
+static int whisper_job_stop(int64_t job_id) {
+    std::lock_guard<std::mutex> lock(g_jobs.mutex);
+    int n_stopped = 0;
+    for (auto & [id, stopped] : g_jobs.running) {
+        if (job_id < 0 || id == job_id) {
+            stopped->store(true, std::memory_order_relaxed);
+            n_stopped++;
+        }
+    }
+    return n_stopped;
+}
+
+static bool whisper_deadline_passed(whisper_print_user_data & data) {
+    if (data.t_deadline_us > 0 && !data.deadline_hit.load(std::memory_order_relaxed) && time_us() >= data.t_deadline_us) {
+        data.deadline_hit.store(true, std::memory_order_relaxed);
+    }
+    return data.deadline_hit.load(std::memory_order_relaxed);
+}
+
+json whisper_transcribe(whisper_params params, const job_progress & progress_cb, int64_t t_arrival_us, whisper_pcm_input * pcm) {
+    job_arena_scope arena;
+
+    json jsonResult;
+    jsonResult["@type"] = "transcribe";
+    jsonResult["segments"] = {};
+
+    const int64_t job_id = ++g_job_id;
+    jsonResult["job_id"] = job_id;
+
+    whisper_job_scope job(job_id);
+
+    log_level_scope log_scope(params.log_level);
+
+    // samples from a binary request stand in for the input file
+    if (pcm != nullptr) {
+        if (!params.fname_inp.empty()) {
+            jsonResult["@type"] = "error";
+            jsonResult["message"] = "file and pcm are exclusive";
+            return jsonResult;
+        }
+        if (params.fname_out.empty() && (!params.output_formats.empty() || (params.resume && params.checkpoint.empty()))) {
+            jsonResult["@type"] = "error";
+            jsonResult["message"] = "output_file is required with pcm input";
+            return jsonResult;
+        }
+        params.fname_inp.emplace_back("");
+    }
+
+    if (params.fname_inp.empty()) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "no input files specified";
+        return jsonResult;
+    }
+
+    if (params.language != "auto" && whisper_lang_id(params.language.c_str()) == -1) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "unknown language";
+        return jsonResult;
+    }
+
+    if (params.diarize && params.tinydiarize) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "error: cannot use both --diarize and --tinydiarize";
+        return jsonResult;
+    }
+
+    if (params.max_len < 0) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "max-len must not be negative";
+        return jsonResult;
+    }
+
+    // whisper.cpp only splits segments when max_len is set
+    if (params.split_on_word && params.max_len == 0) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "split-on-word requires max-len > 0";
+        return jsonResult;
+    }
+
+    if (!params.quantize.empty() && whisper_quantize_ftype(params.quantize) == GGML_FTYPE_UNKNOWN) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "unknown quantization type";
+        return jsonResult;
+    }
+
+    for (const auto & format : params.output_formats) {
+        if (whisper_output_format_from_str(format) < 0) {
+            jsonResult["@type"] = "error";
+            jsonResult["message"] = "unknown output format, expected txt, srt, vtt or lrc";
+            return jsonResult;
+        }
+    }
+
+    // speculative decoding needs the target model's logits for every drafted token
+    // from a single batched decode, but whisper_decode() in whisper.cpp v1.5.4 only
+    // extracts the logits of the last token in the batch. verifying the draft one
+    // token at a time costs as much as plain greedy decoding, so refuse the option
+    // instead of silently ignoring it
+    if (!params.draft_model.empty()) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "draft_model is not supported: whisper_decode only returns logits for the last token";
+        return jsonResult;
+    }
+
+    // before the model is acquired, so that a state or model copy created for
+    // this job is allocated on its node
+    cpu_affinity_scope affinity;
+    std::string affinity_error;
+    if (!affinity.init(params, affinity_error)) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = affinity_error;
+        return jsonResult;
+    }
+
+    whisper_lib_init();
+
+    whisper_timings timings;
+
+    // whisper init
+    whisper_model_lease lease;
+    if (!whisper_model_acquire(params, lease)) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "failed to initialize whisper context";
+        return jsonResult;
+    }
+
+    struct whisper_context * ctx = lease.ctx;
+
+    const int64_t t_load_us = lease.t_load_us;
+
+    // loading and quantizing the model is work for the job, not waiting
+    g_metrics.queue_wait.observe_us(time_us() - t_arrival_us - t_load_us - lease.t_quantize_us);
+
+    // for (int f = 0; f < (int) params.fname_inp.size(); ++f) {
+    for (int f = 0; f < 1; ++f) {
+        const auto fname_inp = params.fname_inp[f];
+        const auto fname_out = f < (int) params.fname_out.size() && !params.fname_out[f].empty() ? params.fname_out[f] : params.fname_inp[f];
+
+        whisper_pcm_input audio(arena.resource(), params.pcm_format);
+
+        {
+            trace_span span("wav_read");
+            std::string error;
+            if (pcm != nullptr) {
+                audio.mono   = std::move(pcm->mono);
+                audio.stereo = std::move(pcm->stereo);
+                if (params.diarize && audio.stereo.size() != 2) {
+                    jsonResult["@type"] = "error";
+                    jsonResult["message"] = "error: diarize requires stereo pcm";
+                    return jsonResult;
+                }
+            } else if (!whisper_read_wav(fname_inp, audio, params.diarize, error)) {
+                LOG_ERR("%s '%s'\n", error.c_str(), fname_inp.c_str());
+                jsonResult["@type"] = "error";
+                jsonResult["message"] = error;
+                return jsonResult;
+            }
+        }
+
+        // print system information
+        {
+            LOG_INF("\n");
+            LOG_INF("system_info: n_threads = %d / %d\n", params.n_threads*params.n_processors, std::thread::hardware_concurrency());
+        }
+
+        // print some info about the processing
+        {
+            LOG_INF("\n");
+            if (!whisper_is_multilingual(ctx)) {
+                if (params.language != "en" || params.translate) {
+                    params.language = "en";
+                    params.translate = false;
+                    LOG_WRN("%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
+                }
+            }
+            if (params.detect_language) {
+                params.language = "auto";
+            }
+            LOG_INF("%s: processing '%s' (%d samples, %.1f sec), %d threads, %d processors, %d beams + best of %d, lang = %s, task = %s, %stimestamps = %d ...\n",
+                    __func__, fname_inp.c_str(), int(audio.mono.size()), float(audio.mono.size())/WHISPER_SAMPLE_RATE,
+                    params.n_threads, params.n_processors, params.beam_size, params.best_of,
+                    params.language.c_str(),
+                    params.translate ? "translate" : "transcribe",
+                    params.tinydiarize ? "tdrz = 1, " : "",
+                    params.no_timestamps ? 0 : 1);
+
+            LOG_INF("\n");
+        }
+
+        // run the inference
+        {
+            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+            wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
+
+            wparams.print_realtime   = false;
+            wparams.print_progress   = params.print_progress;
+            wparams.print_timestamps = !params.no_timestamps;
+            wparams.print_special    = params.print_special;
+            wparams.translate        = params.translate;
+            wparams.language         = params.language.c_str();
+            wparams.detect_language  = params.detect_language;
+            wparams.n_threads        = params.n_threads;
+            wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
+            wparams.offset_ms        = 0; // offset and duration select the samples of each pass below
+            wparams.duration_ms      = 0;
+
+            wparams.token_timestamps = params.max_len > 0 || params.word_timestamps || params.token_data;
+            wparams.thold_pt         = params.word_thold;
+            wparams.max_len          = params.max_len;
+            wparams.split_on_word    = params.split_on_word;
+
+            wparams.speed_up         = params.speed_up;
+            wparams.debug_mode       = params.debug_mode;
+
+            wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+
+            wparams.initial_prompt   = params.prompt.c_str();
+
+            wparams.greedy.best_of        = params.best_of;
+            wparams.beam_search.beam_size = params.beam_size;
+
+            wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
+            wparams.entropy_thold    = params.entropy_thold;
+            wparams.logprob_thold    = params.logprob_thold;
+
+            // whisper tries temperatures 0, inc, 2*inc, ... up to 1.0, so a coarser step
+            // caps the fallbacks per window
+            if (params.fallback_max_window == 0 || params.fallback_max_total == 0) {
+                wparams.temperature_inc = 0.0f;
+            } else if (params.fallback_max_window > 0 && wparams.temperature_inc > 0.0f &&
+                       params.fallback_max_window < (int) std::lround(1.0f/wparams.temperature_inc)) {
+                wparams.temperature_inc = 1.0f/params.fallback_max_window;
+            }
+
+            whisper_output_writer writer;
+            if (!writer.open(fname_out, params.output_formats)) {
+                jsonResult["@type"] = "error";
+                jsonResult["message"] = "failed to open output file";
+                return jsonResult;
+            }
+
+            whisper_print_user_data user_data;
+            user_data.params      = &params;
+            user_data.pcm_stereo  = &audio.stereo;
+            user_data.progress_cb = progress_cb;
+            user_data.writer      = writer.files.empty() ? nullptr : &writer;
+            user_data.stopped     = &job.stopped;
+
+            // audio range of the job, 10 ms units
+            const int64_t t_audio = (int64_t) audio.mono.size()*100/WHISPER_SAMPLE_RATE;
+            const int64_t t_begin = std::min<int64_t>(params.offset_t_ms/10, t_audio);
+            const int64_t t_end   = params.duration_ms > 0 ? std::min<int64_t>(t_audio, t_begin + params.duration_ms/10) : t_audio;
+
+            {
+                whisper_progress_tracker & tracker = user_data.progress;
+                tracker.job_id      = job_id;
+                tracker.interval_us = (int64_t) params.progress_interval_ms*1000;
+                tracker.t_offset    = t_begin;
+                tracker.t_total     = t_end - t_begin;
+            }
+
+            {
+                whisper_fallback_budget & fallback = user_data.fallback;
+                fallback.max_window    = params.fallback_max_window;
+                fallback.max_total     = params.fallback_max_total;
+                fallback.t_deadline_us = params.fallback_deadline_ms > 0 ? t_arrival_us + (int64_t) params.fallback_deadline_ms*1000 : 0;
+                fallback.enabled       = wparams.temperature_inc > 0.0f;
+
+                // the other processors don't stop with the first one, a restart would leave a gap
+                if (lease.state == nullptr && params.n_processors > 1 && (fallback.max_total > 0 || fallback.t_deadline_us > 0)) {
+                    LOG_WRN("%s: the total fallback budget and deadline are not enforced with %d processors\n", __func__, params.n_processors);
+                    fallback.max_total     = -1;
+                    fallback.t_deadline_us = 0;
+                }
+            }
+
+            // a pooled state runs alone, see whisper_full_parallel() below
+            user_data.n_processors = lease.state == nullptr ? std::max(params.n_processors, 1) : 1;
+            user_data.processors.reset(new whisper_processor[user_data.n_processors]);
+
+            // this callback is called on each new segment
+            if (!wparams.print_realtime) {
+                wparams.new_segment_callback           = whisper_print_segment_callback;
+                wparams.new_segment_callback_user_data = &user_data;
+            }
+
+            // always installed: besides reporting progress it marks the window boundaries
+            wparams.progress_callback           = whisper_print_progress_callback;
+            wparams.progress_callback_user_data = &user_data;
+
+            // the first call in every window tells us the encoder has finished, the first
+            // call of every further attempt at a window is a temperature fallback
+            // the other calls, one per decoder and token, return before taking the mutex
+            wparams.logits_filter_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * state, const whisper_token_data * /*tokens*/, int n_tokens, float * /*logits*/, void * user_data) {
+                auto & data = *(whisper_print_user_data *) user_data;
+                whisper_processor & processor = whisper_processor_for(data, state);
+                if (n_tokens > 0 && processor.logits_idle.load(std::memory_order_acquire)) {
+                    return;
+                }
+                std::lock_guard<std::mutex> lock(data.callback_mutex);
+                whisper_clock_on_logits(processor.clock);
+                whisper_fallback_on_logits(processor.fallback, n_tokens);
+                processor.logits_idle.store(n_tokens > 0 && processor.clock.t_decode_start_us > 0, std::memory_order_release);
+            };
+            wparams.logits_filter_callback_user_data = &user_data;
+
+            // examples for abort mechanism
+            // in examples below, we do not abort the processing, but we could if the flag is set to true
+
+            // the callback is called before every encoder run - if it returns false, the processing is aborted
+            {
+                wparams.encoder_begin_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * state, void * user_data) {
+                    auto & data = *(whisper_print_user_data *) user_data;
+                    whisper_processor & processor = whisper_processor_for(data, state);
+                    std::lock_guard<std::mutex> lock(data.callback_mutex);
+                    whisper_clock_on_encoder_begin(processor.clock);
+                    processor.logits_idle.store(false, std::memory_order_release);
+                    if (data.stopped->load(std::memory_order_relaxed) || whisper_deadline_passed(data)) {
+                        return false;
+                    }
+                    if (!whisper_fallback_window_begin(processor.fallback)) {
+                        data.stop_pass = true;
+                        return false;
+                    }
+                    return true;
+                };
+                wparams.encoder_begin_callback_user_data = &user_data;
+            }
+
+            // the callback is called before every computation - if it returns true, the computation is aborted.
+            // this cuts the window being decoded short, the windows before it are kept
+            {
+                wparams.abort_callback = [](void * user_data) {
+                    auto & data = *(whisper_print_user_data *) user_data;
+                    return data.stopped->load(std::memory_order_relaxed) || whisper_deadline_passed(data);
+                };
+                wparams.abort_callback_user_data = &user_data;
+            }
+
+            user_data.t_deadline_us = params.deadline_ms > 0 ? t_arrival_us + (int64_t) params.deadline_ms*1000 : 0;
+
+            // the job runs as one or more passes over [t_begin, t_end). a pass that has to
+            // continue with different decoding parameters stops at a window boundary and the
+            // next one picks up after its last segment, with the language it detected and its
+            // last tokens as the prompt. audio held in a 16-bit format is decoded the same way,
+            // one chunk of at most PCM_CHUNK_LEN per pass converted into window, each chunk
+            // but the last handing its last window over to the next one
+            std::string language = params.language;
+            std::vector<whisper_token> prompt_tokens;
+
+            int64_t t_seek   = t_begin;
+            int     n_tokens = 0;
+            int     n_passes = 0;
+
+            bool budget_exhausted = false;
+
+            int64_t t_covered = t_end;
+
+            const int n_prompt_max = std::min(whisper_n_text_ctx(ctx)/2, wparams.n_max_text_ctx);
+
+            whisper_checkpoint checkpoint;
+            if (!params.checkpoint.empty() || params.resume) {
+                const std::string fname_checkpoint = !params.checkpoint.empty() ? params.checkpoint : fname_out + ".checkpoint";
+
+                // everything that changes which segments the job produces
+                json header;
+                header["file"]      = fname_inp;
+                header["file_size"] = file_size_bytes(fname_inp);
+                header["samples"]   = audio.mono.size();
+                header["model"]     = params.model;
+                header["quantize"]  = params.quantize;
+                header["language"]  = params.language;
+                header["translate"] = params.translate;
+                header["prompt"]    = params.prompt;
+                header["start"]     = t_begin;
+                header["end"]       = t_end;
+
+                std::vector<json> resumed;
+                if (params.resume && whisper_checkpoint_load(fname_checkpoint, header, resumed) && !resumed.empty()) {
+                    for (const auto & segment : resumed) {
+                        const int64_t t0 = segment["start"].get<int64_t>();
+                        const int64_t t1 = segment["end"].get<int64_t>();
+                        const std::string text    = segment["text"].get<std::string>();
+                        const std::string speaker = segment["speaker"].is_string() ? segment["speaker"].get<std::string>() : "";
+
+                        json result;
+                        result["text"] = text;
+                        result["end"] = t1;
+                        result["start"] = t0;
+                        result["speaker"] = speaker;
+                        jsonResult["segments"].push_back(std::move(result));
+
+                        if (!writer.files.empty()) {
+                            writer.write(t0, t1, text.c_str(), speaker.c_str());
+                        }
+                        user_data.n_emitted++;
+                    }
+
+                    t_seek = std::min(std::max(t_begin, resumed.back()["end"].get<int64_t>()), t_end);
+
+                    for (auto it = resumed.rbegin(); it != resumed.rend() && (int) prompt_tokens.size() < n_prompt_max; ++it) {
+                        const json & tokens = (*it)["tokens"];
+                        for (auto jt = tokens.rbegin(); jt != tokens.rend() && (int) prompt_tokens.size() < n_prompt_max; ++jt) {
+                            prompt_tokens.push_back(jt->get<whisper_token>());
+                        }
+                    }
+                    std::reverse(prompt_tokens.begin(), prompt_tokens.end());
+
+                    LOG_INF("%s: resuming '%s' at %.2f s with %d segments from '%s'\n", __func__,
+                            fname_inp.c_str(), t_seek/100.0f, (int) resumed.size(), fname_checkpoint.c_str());
+
+                    jsonResult["resumed"] = { { "segments", resumed.size() }, { "end", t_seek } };
+                }
+
+                if (!checkpoint.create(fname_checkpoint, header, resumed)) {
+                    jsonResult["@type"] = "error";
+                    jsonResult["message"] = "failed to create checkpoint file";
+                    return jsonResult;
+                }
+                user_data.checkpoint = &checkpoint;
+            }
+
+            // a resumed job only decodes the audio after the checkpoint
+            const int64_t t_decode_begin = t_seek;
+
+            const int64_t t_full_start_us = time_us();
+            user_data.progress.t_start_us = t_full_start_us;
+            user_data.progress.t_last_us  = t_full_start_us;
+
+            std::pmr::vector<float> window(arena.resource());
+
+            while (t_seek < t_end) {
+                const int64_t t_pass_end = audio.mono.format == WHISPER_PCM_F32 ? t_end : std::min(t_end, t_seek + PCM_CHUNK_LEN);
+
+                const int64_t i0 = t_seek*WHISPER_SAMPLE_RATE/100;
+                const int64_t i1 = std::min<int64_t>(t_pass_end*WHISPER_SAMPLE_RATE/100, audio.mono.size());
+
+                const float * samples = audio.mono.read(i0, i1 - i0, window);
+
+                user_data.t_pass_offset   = t_seek;
+                user_data.t_pass_len      = t_pass_end - t_seek;
+                user_data.n_segments_prev = jsonResult["segments"].size();
+                user_data.stop_pass       = false;
+
+                // every chunk but the last holds back the segments that reach into its last
+                // window, which the chunk boundary may have cut. the next chunk decodes them again
+                user_data.t_hold = t_pass_end < t_end ? t_pass_end - WHISPER_CHUNK_SIZE*100 : INT64_MAX;
+
+                whisper_processors_begin(user_data);
+
+                wparams.language        = language.c_str();
+                wparams.detect_language = params.detect_language && n_passes == 0;
+                wparams.prompt_tokens   = prompt_tokens.empty() ? nullptr : prompt_tokens.data();
+                wparams.prompt_n_tokens = prompt_tokens.size();
+                if (!user_data.fallback.enabled) {
+                    wparams.temperature_inc = 0.0f;
+                }
+
+                // a pooled state runs on this thread only: whisper_full_parallel() always uses the context's own state
+                const int ret = lease.state == nullptr
+                    ? whisper_full_parallel(ctx, wparams, samples, i1 - i0, params.n_processors)
+                    : whisper_full_with_state(ctx, lease.state, wparams, samples, i1 - i0);
+                const bool aborted = job.stopped.load(std::memory_order_relaxed);
+                const bool stopped = aborted || user_data.deadline_hit;
+                if (ret != 0 && !stopped) {
+                    LOG_ERR("failed to process audio\n");
+                    jsonResult["@type"] = "error";
+                    jsonResult["message"] = "inference failed";
+                    return jsonResult;
+                }
+                n_passes++;
+
+                whisper_processors_end(user_data);
+
+                trace_span span("json_build");
+
+                const int n_segments = whisper_lease_n_segments(lease);
+
+                // a chunk decoded to its end drops the segments it held back
+                int n_kept = n_segments;
+                if (!stopped && !user_data.stop_pass) {
+                    for (n_kept = 0; n_kept < n_segments && t_seek + whisper_lease_segment_t1(lease, n_kept) <= user_data.t_hold; ++n_kept) {
+                    }
+                    if (n_kept < n_segments && whisper_lease_segment_t0(lease, n_kept) <= 0) {
+                        n_kept = n_segments;
+                    }
+                }
+
+                for (int i = 0; i < n_kept; ++i) {
+                    n_tokens += whisper_lease_n_tokens(lease, i);
+
+                    const char * text = whisper_lease_segment_text(lease, i);
+                    const int64_t t0 = t_seek + whisper_lease_segment_t0(lease, i);
+                    const int64_t t1 = t_seek + whisper_lease_segment_t1(lease, i);
+                    std::string speaker = "";
+
+                    if (params.diarize && audio.stereo.size() == 2)
+                    {
+                        speaker = estimate_diarization_speaker(audio.stereo, t0, t1);
+                    }
+
+                    json segment;
+                    segment["text"] = text;
+                    segment["end"] = t1;
+                    segment["start"] = t0;
+                    segment["speaker"] = speaker;
+                    if (params.word_timestamps) {
+                        segment["words"] = whisper_segment_words(lease, i, t_seek);
+                    }
+                    if (params.token_data) {
+                        segment["tokens"] = whisper_segment_tokens(lease, i, t_seek);
+                    }
+                    jsonResult["segments"].push_back(std::move(segment));
+
+                    // whisper_full_parallel() merges the other processors' segments at the end
+                    if (user_data.n_segments_prev + i >= user_data.n_emitted) {
+                        if (!writer.files.empty()) {
+                            writer.write(t0, t1, text, speaker.c_str());
+                        }
+                        if (user_data.checkpoint != nullptr) {
+                            std::vector<whisper_token> tokens;
+                            for (int j = 0; j < whisper_lease_n_tokens(lease, i); ++j) {
+                                const whisper_token id = whisper_lease_token_data(lease, i, j).id;
+                                if (id < whisper_token_eot(ctx)) {
+                                    tokens.push_back(id);
+                                }
+                            }
+                            user_data.checkpoint->append(t0, t1, text, speaker, tokens);
+                        }
+                        user_data.n_emitted++;
+                    }
+                }
+
+                if (user_data.checkpoint != nullptr) {
+                    user_data.checkpoint->flush();
+                }
+
+                if (stopped) {
+                    // whatever was decoded before the stop is returned as is
+                    t_covered = n_kept > 0 ? t_seek + whisper_lease_segment_t1(lease, n_kept - 1) : t_seek;
+
+                    LOG_WRN("%s: %s, returning %.2f s of %.2f s\n", __func__, aborted ? "aborted" : "deadline exceeded",
+                            (t_covered - t_begin)/100.0f, (t_end - t_begin)/100.0f);
+
+                    jsonResult["partial"] = true;
+                    jsonResult["partial_reason"] = aborted ? "aborted" : "deadline";
+                    jsonResult["covered"] = { { "start", t_begin }, { "end", t_covered } };
+                    break;
+                }
+
+                if (!user_data.stop_pass && t_pass_end == t_end) {
+                    break;
+                }
+
+                if (user_data.stop_pass) {
+                    // the rest of the audio is decoded without fallbacks
+                    user_data.fallback.enabled = false;
+                    budget_exhausted = true;
+                }
+
+                if (language == "auto") {
+                    language = whisper_lang_str(whisper_lease_lang_id(lease));
+                }
+
+                if (n_kept > 0) {
+                    const whisper_token token_eot = whisper_token_eot(ctx);
+
+                    prompt_tokens.clear();
+                    for (int i = n_kept - 1; i >= 0 && (int) prompt_tokens.size() < n_prompt_max; --i) {
+                        for (int j = whisper_lease_n_tokens(lease, i) - 1; j >= 0 && (int) prompt_tokens.size() < n_prompt_max; --j) {
+                            const whisper_token id = whisper_lease_token_data(lease, i, j).id;
+                            if (id < token_eot) {
+                                prompt_tokens.push_back(id);
+                            }
+                        }
+                    }
+                    std::reverse(prompt_tokens.begin(), prompt_tokens.end());
+                }
+
+                if (!user_data.stop_pass) {
+                    // the chunk was decoded to its end, the next one starts with the segments it held back
+                    t_seek = n_kept < n_segments ? t_seek + whisper_lease_segment_t0(lease, n_kept) : t_pass_end;
+                    LOG_DBG("%s: chunk decoded, continuing at %.2f s\n", __func__, t_seek/100.0f);
+                    continue;
+                }
+
+                if (n_kept > 0) {
+                    t_seek += whisper_lease_segment_t1(lease, n_kept - 1);
+                }
+
+                LOG_INF("%s: fallback budget used up after %d fallbacks, continuing at %.2f s without fallbacks\n",
+                        __func__, user_data.fallback.n_total, t_seek/100.0f);
+            }
+
+            const int64_t t_full_us = time_us() - t_full_start_us;
+
+            // a partial job keeps its checkpoint so that it can be resumed
+            if (user_data.checkpoint != nullptr) {
+                checkpoint.close();
+                if (!jsonResult.value("partial", false)) {
+                    std::remove(checkpoint.path.c_str());
+                }
+            }
+
+            whisper_progress_update(user_data.progress, t_covered - t_begin, true);
+
+            if (lease.state == nullptr) {
+                whisper_collect_timings(ctx, timings);
+            } else {
+                whisper_clock_timings(user_data.clock, timings);
+            }
+            timings.load_ms     = t_load_us/1000.0f;
+            timings.quantize_ms = lease.t_quantize_us/1000.0f;
+
+            if (!writer.files.empty()) {
+                if (!writer.close()) {
+                    jsonResult["@type"] = "error";
+                    jsonResult["message"] = "failed to write output file";
+                    return jsonResult;
+                }
+
+                json output;
+                for (const auto & file : writer.files) {
+                    output[k_output_ext[file.format]] = file.path;
+                }
+                jsonResult["output"] = output;
+            }
+
+            // audio_ms and rtf cover the audio this job decoded, not the whole file
+            const int64_t n_decoded = std::max<int64_t>(t_covered - t_decode_begin, 0)*WHISPER_SAMPLE_RATE/100;
+
+            json metrics = whisper_metrics_to_json(timings, n_tokens, n_decoded, t_full_us);
+            metrics["pcm_format"]                = k_pcm_format_str[audio.mono.format];
+            metrics["pcm_bytes"]                 = audio.bytes();
+            metrics["passes"]                    = n_passes;
+            metrics["fallbacks"]                 = user_data.fallback.n_total;
+            metrics["fallback_windows_capped"]   = user_data.fallback.n_capped;
+            metrics["fallback_budget_exhausted"] = budget_exhausted;
+            whisper_huge_pages_metrics(lease, metrics);
+            jsonResult["metrics"] = metrics;
+        }
+    }
+    return jsonResult;
+}
+
+json transcribe(const whisper_params & params, const job_progress & progress_cb, int64_t t_arrival_us, whisper_pcm_input * pcm = nullptr) {
+    g_metrics.jobs_started.add();
+
+    json jsonResult = whisper_transcribe(params, progress_cb, t_arrival_us, pcm);
+
+    if (jsonResult["@type"] == "error") {
+        g_metrics.jobs_failed.add();
+    } else if (jsonResult.value("partial_reason", "") == "aborted") {
+        g_metrics.jobs_aborted.add();
+    } else if (jsonResult.value("partial_reason", "") == "deadline") {
+        g_metrics.jobs_deadline.add();
+    } else {
+        g_metrics.jobs_completed.add();
+        g_metrics.audio_seconds.add((uint64_t) jsonResult["metrics"]["audio_ms"].get<float>());
+    }
+
+    return jsonResult;
+}
+
+// runs "files" as separate jobs on up to "parallel" threads. the jobs share one
+// loaded model, each on its own whisper state, and the cores are split between
+// them unless "threads" is given. progress_cb is only called on the calling
+// thread, with the share of the batch that is done; per-job progress is in the
+// job_id-tagged snapshots
+json transcribe_batch(const whisper_request & request, const job_progress & progress_cb) {
+    const int64_t t_start_us = time_us();
+
+    json jsonResult;
+    jsonResult["@type"] = "transcribeBatch";
+
+    if (request.files.empty()) {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "no input files specified";
+        return jsonResult;
+    }
+
+    const int n_files = request.files.size();
+    const int n_jobs  = std::min(std::max(request.params.parallel, 1), n_files);
+
+    whisper_params job = request.params;
+    job.parallel = n_jobs;
+    if (!request.has_threads) {
+        job.n_threads = std::max(1, (int) std::thread::hardware_concurrency()/n_jobs);
+    }
+
+    std::vector<json> results(n_files);
+
+    if (n_jobs == 1) {
+        // everything runs on the calling thread, so the file's own progress
+        // can be folded into the batch total
+        struct file_progress {
+            const job_progress * batch;
+            int i;
+            int n;
+        };
+
+        for (int i = 0; i < n_files; ++i) {
+            file_progress ctx = { &progress_cb, i, n_files };
+            const job_progress file_cb([](void * ctx, int progress) {
+                const file_progress * p = (const file_progress *) ctx;
+                (*p->batch)((p->i*100 + progress)/p->n);
+            }, &ctx);
+
+            whisper_params params = job;
+            params.fname_inp.assign(1, request.files[i]);
+            results[i] = transcribe(params, file_cb, t_start_us);
+        }
+    } else {
+        std::atomic<int> next{0};
+        std::mutex done_mutex;
+        std::condition_variable done_cv;
+        int n_done = 0;
+
+        auto worker = [&]() {
+            for (int i = next++; i < n_files; i = next++) {
+                whisper_params params = job;
+                params.fname_inp.assign(1, request.files[i]);
+                results[i] = transcribe(params, job_progress(), t_start_us);
+
+                std::lock_guard<std::mutex> lock(done_mutex);
+                n_done++;
+                done_cv.notify_one();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int i = 0; i < n_jobs; ++i) {
+            workers.emplace_back(worker);
+        }
+
+        // the workers never call progress_cb: hosts such as Dart can only
+        // take callbacks on the thread that made the request
+        std::unique_lock<std::mutex> lock(done_mutex);
+        for (int n_reported = 0; n_reported < n_files; ) {
+            done_cv.wait(lock, [&]() { return n_done > n_reported; });
+            n_reported = n_done;
+            lock.unlock();
+            progress_cb(n_reported*100/n_files);
+            lock.lock();
+        }
+        lock.unlock();
+
+        for (auto & thread : workers) {
+            thread.join();
+        }
+    }
+
+    float audio_ms = 0.0f;
+    int   n_failed = 0;
+    for (const json & result : results) {
+        if (result["@type"] == "error") {
+            n_failed++;
+        } else {
+            audio_ms += result["metrics"]["audio_ms"].get<float>();
+        }
+    }
+
+    const float wall_ms = (time_us() - t_start_us)/1000.0f;
+
+    json metrics;
+    metrics["jobs"]     = n_jobs;
+    metrics["failed"]   = n_failed;
+    metrics["audio_ms"] = audio_ms;
+    metrics["wall_ms"]  = wall_ms;
+    metrics["rtf"]      = audio_ms > 0.0f ? wall_ms/audio_ms : 0.0f;
+
+    jsonResult["results"] = results;
+    jsonResult["metrics"] = metrics;
+    return jsonResult;
+}
+
+// shared by request(), request_binary() and the socket server
+json request_dispatch(const whisper_request & request, const job_progress & progress_cb) {
+    json jsonResult;
+
+    if (request.type == "transcribe") {
+        return transcribe(request.params, progress_cb, time_us());
+    }
+
+    if (request.type == "transcribeBatch") {
+        return transcribe_batch(request, progress_cb);
+    }
+
+    if (request.type == "loadModel") {
+        return load_model(request);
+    }
+
+    if (request.type == "autotune") {
+        return autotune(request);
+    }
+
+    if (request.type == "getVersion") {
+        jsonResult["@type"] = "version";
+        jsonResult["message"] = "version lib v0.0.0";
+        return jsonResult;
+    }
+
+    jsonResult["@type"] = "error";
+    jsonResult["message"] = "method not found";
+
+    return jsonResult;
+}
+
+json request_text(const char * text, size_t size, const job_progress & progress_cb) {
+    whisper_request request;
+    std::string error;
+
+    if (!whisper_request_parse(text, size, request, error)) {
+        json jsonResult;
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = error;
+        return jsonResult;
+    }
+
+    return request_dispatch(request, progress_cb);
+}
+
+//
+// binary requests
+//
+// a length-prefixed frame of typed fields, so audio and large prompts travel as
+// raw bytes and nothing has to be parsed as text. all values are little-endian:
+//
+//   header   "MPWB", u32 frame size (header included), u32 field count
+//   field    u8 type, u8 key length, u32 value size, key, value
+//
+// keys are those of the JSON requests and go through the same field table. the
+// samples go in a "pcm" field at 16 kHz, interleaved when an int "channels"
+// field is 2
+//
+
+#define REQUEST_FRAME_MAGIC       "MPWB"
+#define REQUEST_FRAME_HEADER_SIZE 12
+
+enum request_field_type {
+    REQUEST_FIELD_INT     = 1, // i64
+    REQUEST_FIELD_FLOAT   = 2, // f64
+    REQUEST_FIELD_BOOL    = 3, // u8
+    REQUEST_FIELD_STRING  = 4, // utf-8, not terminated
+    REQUEST_FIELD_STRINGS = 5, // utf-8 strings, each terminated by a NUL
+    REQUEST_FIELD_PCM_F32 = 6,
+    REQUEST_FIELD_PCM_S16 = 7,
+};
+
+template <typename T>
+static T request_frame_read(const uint8_t * data) {
+    T value;
+    memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+// fills request with the fields and pcm with the samples, if any
+// the samples of a frame's "pcm" field, decoded once the job's arena is open
+struct request_frame_pcm {
+    const uint8_t * data       = nullptr;
+    uint32_t        size       = 0;
+    int             type       = 0;
+    int64_t         n_channels = 1;
+};
+
+static bool request_frame_parse(const uint8_t * data, size_t size, whisper_request & request, request_frame_pcm & pcm, std::string & error) {
+    if (size < REQUEST_FRAME_HEADER_SIZE || memcmp(data, REQUEST_FRAME_MAGIC, 4) != 0) {
+        error = "invalid frame header";
+        return false;
+    }
+
+    if (request_frame_read<uint32_t>(data + 4) != size) {
+        error = "frame size mismatch";
+        return false;
+    }
+
+    const uint32_t n_fields = request_frame_read<uint32_t>(data + 8);
+
+    pcm = request_frame_pcm();
+
+    request_value val;
+
+    size_t pos = REQUEST_FRAME_HEADER_SIZE;
+    for (uint32_t i = 0; i < n_fields; ++i) {
+        if (size - pos < 6) {
+            error = "truncated field header";
+            return false;
+        }
+
+        const uint8_t  type       = data[pos];
+        const uint8_t  key_size   = data[pos + 1];
+        const uint32_t value_size = request_frame_read<uint32_t>(data + pos + 2);
+        pos += 6;
+
+        if (size - pos < (size_t) key_size + value_size) {
+            error = "truncated field";
+            return false;
+        }
+
+        const std::string key((const char *) data + pos, key_size);
+        const uint8_t * value = data + pos + key_size;
+        pos += key_size + value_size;
+
+        if (type == REQUEST_FIELD_PCM_F32 || type == REQUEST_FIELD_PCM_S16) {
+            if (key != "pcm") {
+                error = "unexpected samples in field '" + key + "'";
+                return false;
+            }
+            pcm.data = value;
+            pcm.size = value_size;
+            pcm.type = type;
+            continue;
+        }
+
+        if (key == "channels") {
+            if (type != REQUEST_FIELD_INT || value_size != 8) {
+                error = "field 'channels' must be an integer";
+                return false;
+            }
+            pcm.n_channels = request_frame_read<int64_t>(value);
+            continue;
+        }
+
+        const request_field * field = request_field_find(key);
+        if (field == nullptr) {
+            error = "unknown field '" + key + "'";
+            return false;
+        }
+
+        request_value_type value_type;
+        switch (type) {
+            case REQUEST_FIELD_INT:
+            case REQUEST_FIELD_FLOAT:
+                if (value_size != 8) {
+                    error = "field '" + key + "' must be 8 bytes";
+                    return false;
+                }
+                if (type == REQUEST_FIELD_INT) {
+                    val.i = request_frame_read<int64_t>(value);
+                    val.f = (double) val.i;
+                    value_type = REQUEST_VALUE_INT;
+                } else {
+                    val.f = request_frame_read<double>(value);
+                    value_type = REQUEST_VALUE_FLOAT;
+                }
+                break;
+            case REQUEST_FIELD_BOOL:
+                if (value_size != 1) {
+                    error = "field '" + key + "' must be 1 byte";
+                    return false;
+                }
+                val.b = value[0] != 0;
+                value_type = REQUEST_VALUE_BOOL;
+                break;
+            case REQUEST_FIELD_STRING:
+                val.s.assign((const char *) value, value_size);
+                value_type = REQUEST_VALUE_STRING;
+                break;
+            case REQUEST_FIELD_STRINGS:
+                val.strs.clear();
+                for (uint32_t j = 0; j < value_size; ) {
+                    const uint8_t * end = (const uint8_t *) memchr(value + j, 0, value_size - j);
+                    if (end == nullptr) {
+                        error = "field '" + key + "' has an unterminated string";
+                        return false;
+                    }
+                    val.strs.emplace_back((const char *) value + j, end - (value + j));
+                    j = end - value + 1;
+                }
+                value_type = REQUEST_VALUE_STRINGS;
+                break;
+            default:
+                error = "field '" + key + "' has unknown type " + std::to_string(type);
+                return false;
+        }
+
+        // same leniency as the JSON reader: an int fills a float field
+        const bool compatible = value_type == field->type || (value_type == REQUEST_VALUE_INT && field->type == REQUEST_VALUE_FLOAT);
+        if (!compatible) {
+            error = request_field_type_error(*field);
+            return false;
+        }
+
+        if (!request_field_set(*field, request, val, error)) {
+            return false;
+        }
+    }
+
+    if (!whisper_request_apply_preset(request, error)) {
+        return false;
+    }
+    whisper_request_apply_defaults(request);
+
+    if (pcm.data != nullptr) {
+        const size_t sample_size = pcm.type == REQUEST_FIELD_PCM_F32 ? sizeof(float) : sizeof(int16_t);
+        if ((pcm.n_channels != 1 && pcm.n_channels != 2) || pcm.size % (sample_size*pcm.n_channels) != 0) {
+            error = "pcm must be mono or stereo and hold whole samples";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// same conversion as read_wav(), into the format pcm was created with
+static void request_frame_decode_pcm(const request_frame_pcm & frame, whisper_pcm_input & pcm) {
+    const uint8_t * pcm_data   = frame.data;
+    const int       pcm_type   = frame.type;
+    const int64_t   n_channels = frame.n_channels;
+
+    const size_t sample_size = pcm_type == REQUEST_FIELD_PCM_F32 ? sizeof(float) : sizeof(int16_t);
+    const size_t n = frame.size/(sample_size*n_channels);
+
+    auto sample = [&](size_t i) {
+        return pcm_type == REQUEST_FIELD_PCM_F32
+            ? request_frame_read<float>(pcm_data + i*sizeof(float))
+            : request_frame_read<int16_t>(pcm_data + i*sizeof(int16_t))/32768.0f;
+    };
+
+    pcm.mono.resize(n);
+    if (n_channels == 1) {
+        if (pcm_type == REQUEST_FIELD_PCM_F32 && pcm.mono.format == WHISPER_PCM_F32) {
+            memcpy(pcm.mono.f32.data(), pcm_data, n*sizeof(float));
+        } else if (pcm_type == REQUEST_FIELD_PCM_S16 && pcm.mono.format == WHISPER_PCM_S16) {
+            memcpy(pcm.mono.s16.data(), pcm_data, n*sizeof(int16_t));
+        } else {
+            for (size_t i = 0; i < n; ++i) {
+                pcm.mono.set(i, sample(i));
+            }
+        }
+    } else {
+        pcm.resize_stereo(n);
+        for (size_t i = 0; i < n; ++i) {
+            const float s0 = sample(2*i + 0);
+            const float s1 = sample(2*i + 1);
+            pcm.stereo[0].set(i, s0);
+            pcm.stereo[1].set(i, s1);
+            pcm.mono.set(i, (s0 + s1)/2.0f);
+        }
+    }
+}
+
+json request_binary_json(const uint8_t * data, size_t size, const job_progress & progress_cb) {
+    whisper_request request;
+    request_frame_pcm frame_pcm;
+    std::string error;
+
+    if (!request_frame_parse(data, size, request, frame_pcm, error)) {
+        json jsonResult;
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "invalid binary request: " + error;
+        return jsonResult;
+    }
+
+    if (frame_pcm.data != nullptr) {
+        if (request.type != "transcribe") {
+            json jsonResult;
+            jsonResult["@type"] = "error";
+            jsonResult["message"] = "pcm is only accepted by transcribe";
+            return jsonResult;
+        }
+
+        // opened before the samples are decoded into it, the job's scope nests in this one
+        job_arena_scope arena;
+
+        whisper_pcm_input pcm(arena.resource(), request.params.pcm_format);
+        request_frame_decode_pcm(frame_pcm, pcm);
+
+        return transcribe(request.params, progress_cb, time_us(), &pcm);
+    }
+
+    return request_dispatch(request, progress_cb);
+}
+
+extern "C" {
+    // stops every job running now
+    void stop_transcribe() {
+        whisper_job_stop(-1);
+    }
+
+    // stops the job with the job_id from its progress or result, false if it isn't running
+    bool stop_job(long long job_id) {
+        return job_id >= 0 && whisper_job_stop(job_id) > 0;
+    }
+
+    // level: 0 none, 1 error, 2 warn, 3 info, 4 debug
+    void log_set_level(int level) {
+        g_log.level.store(level, std::memory_order_relaxed);
+    }
+
+    // append log output to the given file instead of stderr, nullptr restores stderr
+    bool log_set_file(const char *path) {
+        FILE * sink = nullptr;
+        if (path != nullptr && (sink = fopen(path, "a")) == nullptr) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(g_log.sink_mutex);
+        if (g_log.sink != nullptr) {
+            fclose(g_log.sink);
+        }
+        g_log.sink = sink;
+        return true;
+    }
+
+    // snapshots are delivered from a background thread; the listener must not block for long
+    void set_progress_listener(progress_listener listener) {
+        g_progress.listener.store(listener, std::memory_order_release);
+        if (listener != nullptr) {
+            progress_start_dispatcher();
+        }
+    }
+
+    // pops the oldest queued snapshot, for hosts that can't receive calls from foreign threads
+    bool progress_poll(whisper_progress *out) {
+        std::lock_guard<std::mutex> lock(g_progress.pop_mutex);
+        return g_progress.ring.try_pop([&](const whisper_progress & progress) { *out = progress; });
+    }
+
+    void trace_enable(bool enable) {
+        g_trace.enabled.store(enable, std::memory_order_relaxed);
+    }
+
+    void trace_clear() {
+        g_trace.tail.store(g_trace.head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    // 0 disables the budget; idle models over budget are evicted right away
+    void set_model_memory_budget(int64_t bytes) {
+        std::lock_guard<std::mutex> lock(g_models.mutex);
+        g_models.budget_bytes = std::max<int64_t>(bytes, 0);
+        whisper_model_evict_locked(0, nullptr);
+    }
+
+    // resident models with their estimated sizes, as JSON
+    char *model_cache_status() {
+        return jsonToChar(whisper_model_cache_to_json());
+    }
+
+    // Chrome trace event format, loadable in chrome://tracing or ui.perfetto.dev
+    char *trace_export() {
+        return jsonToChar(trace_to_json());
+    }
+
+    // Prometheus text exposition format
+    char *metrics_export() {
+        std::string result = metrics_to_prometheus();
+        char *ch = new char[result.size() + 1];
+        strcpy(ch, result.c_str());
+        return ch;
+    }
+
+    char *request(char *body, progress_callback progress_cb) {
+        return jsonToChar(request_text(body, strlen(body), progress_cb));
+    }
+
+    // every string returned by this library - request(), request_binary(),
+    // preset_register(), model_cache_status(), trace_export(), metrics_export() -
+    // is owned by the caller and has to be handed back here once read
+    void free_result(char *result) {
+        delete[] result;
+    }
+
+    // registers, or replaces, a preset that requests can name in "preset". body
+    // holds request fields, and may itself name a preset to start from
+    char *preset_register(const char *name, const char *body) {
+        json jsonResult;
+        whisper_request preset;
+        std::string error;
+
+        if (name == nullptr || name[0] == '\0') {
+            error = "preset name is empty";
+        } else if (body == nullptr) {
+            error = "preset body is empty";
+        } else if (whisper_request_parse(body, strlen(body), preset, error)) {
+            preset.type.clear();
+            preset.preset = name;
+
+            std::lock_guard<std::mutex> lock(g_presets.mutex);
+            g_presets.presets[name] = std::move(preset);
+        }
+
+        if (!error.empty()) {
+            jsonResult["@type"] = "error";
+            jsonResult["message"] = error;
+            return jsonToChar(jsonResult);
+        }
+
+        jsonResult["@type"] = "preset";
+        jsonResult["name"]  = name;
+        return jsonToChar(jsonResult);
+    }
+
+    // pins jobs that don't give "cpus" or "numa_node" to these. nullptr or ""
+    // for no cpu list, -1 for no node
+    void set_default_affinity(const char *cpus, int numa_node) {
+        std::lock_guard<std::mutex> lock(g_affinity.mutex);
+        g_affinity.cpus      = cpus != nullptr ? cpus : "";
+        g_affinity.numa_node = numa_node;
+    }
+
+    // "parallel" for requests that don't give it: how many jobs may run on one
+    // loaded model at a time. 1, the default, runs them one after the other
+    void set_default_parallel(int parallel) {
+        g_parallel_default.store(std::max(parallel, 1), std::memory_order_relaxed);
+    }
+
+    // where autotune results are saved and read from; nullptr restores the
+    // default, "" keeps them in memory only. later requests read the new file
+    void autotune_set_path(const char *path) {
+        std::lock_guard<std::mutex> lock(g_autotune.mutex);
+        g_autotune.loaded       = false;
+        g_autotune.has_path     = path != nullptr;
+        g_autotune.path         = path != nullptr ? path : "";
+        g_autotune.n_threads    = 0;
+        g_autotune.n_processors = 0;
+    }
+
+    // same as request() for a binary frame, the response is JSON
+    char *request_binary(const uint8_t *data, size_t size, progress_callback progress_cb) {
+        return jsonToChar(request_binary_json(data, size, progress_cb));
+    }
+}
+
+#if !defined(_WIN32)
+
+//
+// socket server
+//
+// one resident process per host: clients connect to a unix socket and send the
+// same JSON requests as request(), one per line, or binary frames as taken by
+// request_binary(). every response is a single JSON line; "progress" lines may
+// precede a transcription result. each connection
+// is served by its own thread. jobs from different clients share the loaded
+// models; how many of them run on one model at a time is their "parallel"
+// setting, --parallel for the requests that don't give it. the others wait
+// for a state
+//
+
+// largest request a client may send, so one connection can't make the server
+// buffer gigabytes: 70 minutes of mono F32 pcm, or over 2 hours of S16
+#define SERVER_REQUEST_MAX (256u << 20)
+
+static char g_server_path[sizeof(sockaddr_un::sun_path)];
+
+static bool server_write_all(int fd, const char * data, size_t size) {
+    while (size > 0) {
+        const ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+struct server_client {
+    int fd = -1;
+
+    // progress lines come from the workers of a transcribeBatch job too
+    std::mutex write_mutex;
+};
+
+static bool server_write_json(server_client & client, const json & message) {
+    std::string line = message.dump(-1, ' ', false, json::error_handler_t::ignore);
+    line += '\n';
+
+    std::lock_guard<std::mutex> lock(client.write_mutex);
+    return server_write_all(client.fd, line.data(), line.size());
+}
+
+static void server_progress_callback(void * ctx, int progress) {
+    server_write_json(*(server_client *) ctx, { { "@type", "progress" }, { "progress", progress } });
+}
+
+static void server_serve_client(int fd) {
+    server_client client;
+    client.fd = fd;
+
+    const job_progress progress(server_progress_callback, &client);
+
+    std::string buf;
+    std::vector<char> chunk(64*1024);
+
+    while (true) {
+        const ssize_t n = read(fd, chunk.data(), chunk.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        buf.append(chunk.data(), n);
+
+        bool ok = true;
+
+        size_t pos = 0;
+        while (ok && pos < buf.size()) {
+            const size_t n_avail = buf.size() - pos;
+
+            json jsonResult;
+
+            // a JSON request can't start with the magic
+            if (buf.compare(pos, std::min<size_t>(n_avail, 4), REQUEST_FRAME_MAGIC, std::min<size_t>(n_avail, 4)) == 0) {
+                if (n_avail < 8) {
+                    break;
+                }
+                const uint32_t size = request_frame_read<uint32_t>((const uint8_t *) buf.data() + pos + 4);
+                if (size < REQUEST_FRAME_HEADER_SIZE) {
+                    server_write_json(client, { { "@type", "error" }, { "message", "invalid binary request: frame size" } });
+                    ok = false;
+                    break;
+                }
+                if (size > SERVER_REQUEST_MAX) {
+                    server_write_json(client, { { "@type", "error" }, { "message", "invalid binary request: frame too large" } });
+                    ok = false;
+                    break;
+                }
+                if (n_avail < size) {
+                    break;
+                }
+                jsonResult = request_binary_json((const uint8_t *) buf.data() + pos, size, progress);
+                pos += size;
+            } else {
+                const size_t eol = buf.find('\n', pos);
+                if (eol == std::string::npos) {
+                    if (n_avail > SERVER_REQUEST_MAX) {
+                        server_write_json(client, { { "@type", "error" }, { "message", "request too large" } });
+                        ok = false;
+                    }
+                    break;
+                }
+
+                const size_t begin = pos;
+                pos = eol + 1;
+                if (eol == begin) {
+                    continue;
+                }
+
+                jsonResult = request_text(buf.data() + begin, eol - begin, progress);
+            }
+
+            ok = server_write_json(client, jsonResult);
+        }
+        buf.erase(0, pos);
+
+        if (!ok) {
+            break;
+        }
+    }
+
+    close(fd);
+}
+
+static void server_on_signal(int /*signum*/) {
+    unlink(g_server_path);
+    _exit(0);
+}
+
+static int server_run(const std::string & path) {
+    if (path.size() >= sizeof(g_server_path)) {
+        LOG_ERR("%s: socket path '%s' is too long\n", __func__, path.c_str());
+        return 1;
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        LOG_ERR("%s: socket() failed: %s\n", __func__, strerror(errno));
+        return 1;
+    }
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    strncpy(g_server_path, path.c_str(), sizeof(g_server_path) - 1);
+
+    // a stale socket from a previous run would make bind() fail
+    unlink(path.c_str());
+
+    // clients of the same user only. the socket is created 0600 rather than
+    // chmod-ed after bind(), which would leave it open to others until then
+    const mode_t umask_prev = umask(0177);
+    const bool bound = bind(fd, (sockaddr *) &addr, sizeof(addr)) == 0;
+    umask(umask_prev);
+
+    if (!bound || listen(fd, 64) != 0) {
+        LOG_ERR("%s: failed to listen on '%s': %s\n", __func__, path.c_str(), strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT,  server_on_signal);
+    signal(SIGTERM, server_on_signal);
+
+    LOG_INF("%s: listening on '%s'\n", __func__, path.c_str());
+
+    while (true) {
+        const int client = accept(fd, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            LOG_ERR("%s: accept() failed: %s\n", __func__, strerror(errno));
+            break;
+        }
+        std::thread(server_serve_client, client).detach();
+    }
+
+    close(fd);
+    unlink(path.c_str());
+    return 1;
+}
+
+#endif
+
+// the whole argument as an integer, false instead of an exception on bad input
+static bool arg_to_int64(const char * arg, int64_t & value) {
+    char * end = nullptr;
+    errno = 0;
+    const long long v = strtoll(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno == ERANGE) {
+        return false;
+    }
+    value = v;
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    int64_t value = 0;
+
+    std::string socket_path;
+    std::string cpus;
+    int         numa_node = -1;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--socket" && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (arg == "--memory-budget" && i + 1 < argc && arg_to_int64(argv[i + 1], value) && value >= 0) {
+            set_model_memory_budget(value);
+            ++i;
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            log_set_level(std::max(log_level_from_str(argv[++i]), 0));
+        } else if (arg == "--autotune-config" && i + 1 < argc) {
+            autotune_set_path(argv[++i]);
+        } else if (arg == "--cpus" && i + 1 < argc) {
+            cpus = argv[++i];
+        } else if (arg == "--numa-node" && i + 1 < argc && arg_to_int64(argv[i + 1], value) && value >= -1 && value <= INT32_MAX) {
+            numa_node = (int) value;
+            ++i;
+        } else if (arg == "--parallel" && i + 1 < argc && arg_to_int64(argv[i + 1], value) && value >= 1 && value <= INT32_MAX) {
+            set_default_parallel((int) value);
+            ++i;
+        } else {
+            fprintf(stderr, "usage: %s [--socket PATH] [--memory-budget BYTES] [--log-level LEVEL] [--autotune-config PATH] [--cpus LIST] [--numa-node NODE] [--parallel N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    set_default_affinity(cpus.c_str(), numa_node);
+
+    if (!socket_path.empty()) {
+#if !defined(_WIN32)
+        const int ret = server_run(socket_path);
+        log_flush();
+        return ret;
+#else
+        fprintf(stderr, "%s: --socket is not supported on this platform\n", argv[0]);
+        return 1;
+#endif
+    }
+
+    const char * body = R"({
         "@type": "transcribe",
         "model": "",
         "file": "",
         "prompt": "添加标点符号：，。；？！",
         "language": "en",
         "translate": true
-    })");
-    json ret = transcribe(jsonBody, nullptr);
+    })";
+    json ret = request_text(body, strlen(body), nullptr);
+    log_flush();
     printf("%s", jsonToChar(ret));
     return 0;
 }
\ No newline at end of file